@@ -7,27 +7,55 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 /* Defines */
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+// Seconds a status message stays up for
+#define KILO_STATUS_TIMEOUT 5
+// How hard editorSave tries to make sure a save survives a crash, can be
+// overridden with KILO_DURABILITY=none|file|full in the environment
+#define KILO_DURABILITY DURABILITY_FILE
+// Whether the timing overlay in the status bar starts out shown, Ctrl-T
+// toggles it
 #define DEBUG 0
 
 // Strip the 5th and 6th bits from alpha characters to give us something
 // between 1 - 26, i.e. the range of inputs of <ctrl-a> to <ctrl-z>
 #define CTRL_KEY(k) ((k) & 0x1f)
 
+// Keys that insert themselves: tab, printable ASCII and the bytes of UTF-8
+#define IS_TEXT_KEY(c) ((c) == '\t' || ((c) >= 32 && (c) < 256 && (c) != 127))
+
 enum editorKey {
   BACKSPACE = 127,
   // These need to be out of the range of normal chars
@@ -40,20 +68,183 @@ enum editorKey {
   END_KEY,           /* <esc>[4~, <esc>[8~, <esc>[F, or <esc>OF */
   PAGE_UP,           /* <esc>[5~ */
   PAGE_DOWN,         /* <esc>[6~ */
+  // Not a key, returned when we stopped waiting for one because something
+  // running in the background wants the screen redrawn
+  NO_KEY,
+  // Text pasted in one go, between <esc>[200~ and <esc>[201~. See input.paste
+  PASTE,
+};
+
+enum editorDurability {
+  DURABILITY_NONE, // Leave it to the kernel to write things out
+  DURABILITY_FILE, // fsync the file before renaming it into place
+  DURABILITY_FULL, // Also fsync the directory so the rename sticks
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+};
+
+// What a highlighter carries over from the end of one row to the next
+enum editorHighlightState {
+  HLS_NORMAL = 0,
+  HLS_COMMENT, // Inside a /* */ comment
+  // Stored as a row's `hl_start` when it has to be highlighted again
+  HLS_STALE = 0xff,
 };
 
-enum editorHighlight { HL_NORMAL = 0, HL_NUMBER };
+// Screen cells store a highlight, plus this bit for the inverted status bar
+#define CELL_INVERSE 0x80
 
 /* Data */
 
+// One character cell of the terminal as we last drew it. `c` holds the UTF-8
+// for it, NUL padded, and is empty in the right half of a wide char.
+typedef struct screencell {
+  char c[8];
+  unsigned char attr;
+} screencell;
+
+#define CELL_BLANK ((screencell){" ", HL_NORMAL})
+
+// Row memory is carved out of big slabs in power-of-two sized blocks, with a
+// free list for each size. Blocks too big for a slab get their own malloc but
+// are still tracked here, so closing a file can release everything at once.
+#define ARENA_MIN_BLOCK 16
+#define ARENA_CLASSES 9 // 16 bytes up to 4KB
+#define ARENA_MAX_BLOCK (ARENA_MIN_BLOCK << (ARENA_CLASSES - 1))
+#define ARENA_SLAB_SIZE (256 * 1024)
+
+typedef struct arenaslab {
+  struct arenaslab *next;
+  // Pads the header so the blocks after it stay 16 byte aligned
+  struct arenaslab *unused;
+} arenaslab;
+
+typedef struct arenalarge {
+  struct arenalarge *prev, *next;
+} arenalarge;
+
+struct arena {
+  void *free[ARENA_CLASSES];
+  arenaslab *slabs;
+  // Unused part of the newest slab
+  char *top, *end;
+  arenalarge *large;
+  int nslabs;
+  // Blocks handed out, for the timing overlay
+  long long allocs;
+};
+
+// A tab in some row, see editorRowCxToRx
+typedef struct tabstop {
+  int cx; // Where it is in `chars`
+  int rx; // The column in `render` right after it
+} tabstop;
+
 typedef struct erow {
   int size;
   int rsize;
+  // Either taken from the arena and NUL-terminated, or (if `ccap` is 0) a
+  // read-only slice of the memory-mapped file that is not NUL-terminated
   char *chars;
-  char *render;      // Actual chars that we render
-  unsigned char *hl; // Highlighting
+  int ccap;
+  // Which save snapshot was current when `chars` was allocated
+  unsigned gen;
+  // Every tab in the row in order, kept up to date along with `render`
+  tabstop *tabs;
+  int ntabs, tabcap;
+  // Actual chars that we render, NULL until first needed. `hl` holds the
+  // highlighting and shares the same block, starting `rcap` bytes in.
+  char *render;
+  unsigned char *hl;
+  int rcap;
+  // The highlighter state the row was last highlighted from and the state it
+  // ended up in, see editorSyntaxUpTo. `hl_drawn` is the state `hl` was
+  // filled in from, which can lag behind as only rows on screen need it.
+  unsigned char hl_start, hl_state;
+  unsigned char hl_drawn;
+  // Set when `render` has more than ASCII in it, see editorUpdateRowUtf8
+  unsigned char utf8;
+  // Screen lines the row takes up with soft wrap on, see editorWrapUpdate.
+  // The row tree adds these up along with the rows. Only good while
+  // `wrapgen` matches E.wrapgen, see editorWrapView.
+  int height;
+  unsigned wrapgen;
 } erow;
 
+typedef struct keyword {
+  const char *word;
+  unsigned char hl;
+} keyword;
+
+// A language we know how to highlight. `highlight` fills in `hl` for `len`
+// chars of `s` starting from `state` and returns the state at the end.
+// `hl` may be NULL when all that's wanted is the state.
+struct editorSyntax {
+  char *filetype;
+  // Extensions (starting with a '.') or names anywhere in the filename
+  char **filematch;
+  int (*highlight)(struct editorSyntax *syntax, char *s, int len,
+                   unsigned char *hl, int state);
+  // Perfect hash table of keywords, see editorKeywordHash
+  const keyword *keywords;
+};
+
+// Rows live in a B-tree ordered by position, each inner node knowing how many
+// rows sit under each of its children. This keeps inserting or deleting a row
+// anywhere in the file O(log n) rather than shifting every row after it. The
+// nodes also count the screen lines under each child, so going between rows
+// and lines on screen when wrapping is O(log n) as well.
+#define ROWTREE_FANOUT 64
+
+typedef struct rownode {
+  int leaf;
+  // Number of rows in a leaf, or number of children of an inner node
+  int n;
+} rownode;
+
+// A leaf made when the file was loaded starts out knowing no more about its
+// lines than where they are in the mapping, line `j` being base[off[j],
+// off[j + 1] - 1) less any trailing \r, and the states editorSyntaxScan
+// leaves for them. `row` stays NULL until something needs the rows
+// themselves, see rowtreeExpand, so lines that are never looked at up close
+// cost a few bytes each rather than a whole erow.
+typedef struct rowleaf {
+  rownode h;
+  // Leaves are linked in order so whole-file scans don't go through the root
+  struct rowleaf *prev, *next;
+  erow *row;
+  char *base;
+  uint32_t off[ROWTREE_FANOUT + 1];
+  unsigned char hl_start[ROWTREE_FANOUT], hl_state[ROWTREE_FANOUT];
+} rowleaf;
+
+typedef struct rowinner {
+  rownode h;
+  int count[ROWTREE_FANOUT];
+  int lines[ROWTREE_FANOUT];
+  rownode *child[ROWTREE_FANOUT];
+} rowinner;
+
+// Walks rows in order starting from some position, see editorRowIterNext.
+// `row` is what editorRowIterText found in `leaf->row` on getting to it.
+typedef struct rowiter {
+  rowleaf *leaf;
+  int i;
+  erow *row;
+} rowiter;
+
 struct editorConfig {
   // Cursor coordinates within the open file, (0, 0) is the top left
   int cx, cy;
@@ -63,13 +254,42 @@ struct editorConfig {
   int rowoff;
   // Column offset, i.e. which column the user is scrolled to (1st visible col)
   int coloff;
+  // Whether long rows wrap onto the next screen line rather than scroll
+  // sideways, and if so how many lines of row `rowoff` are above the screen
+  int wrap;
+  int wrapoff;
+  // Bumped whenever every row's height goes out of date, see editorWrapView
+  unsigned wrapgen;
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  rownode *rows;
+  // Where the rows' chars, render and hl come from, for all `nbuffers` files
+  // that are open, see editorBufferOpen
+  struct arena arena;
+  int nbuffers;
+  // The file we opened, mapped read-only so rows can be sliced out of it lazily
+  char *map;
+  size_t maplen;
   // Whether the file has unsaved modifications
   int dirty;
+  // Set with -r, nothing can be changed and big files are paged, see pagerOpen
+  int readonly;
   char *filename;
+  // How to highlight the file, if we know, and how many rows from the top
+  // have their highlighting up to date
+  struct editorSyntax *syntax;
+  int hl_valid;
+  // What's currently on the terminal, see editorRefreshScreen. `frame_valid`
+  // is 0 when we don't know, `frame_rowoff` is the editorTopLine it was drawn
+  // at and `termattr` the attributes the terminal is currently set to.
+  screencell *frame;
+  int framerows, framecols;
+  int frame_valid;
+  int frame_rowoff;
+  unsigned char termattr;
+  // Set when running a script over files rather than editing on a terminal
+  int batch;
   // The message we display in the status bar as well as when it was set
   char statusmsg[80];
   time_t statusmsg_time;
@@ -79,23 +299,147 @@ struct editorConfig {
 // Global struct containing editor state
 struct editorConfig E;
 
+// Where the time went in the last frame, see editorRefreshScreen. Shown in
+// the status bar when `overlay` is set, and written to a Chrome trace (for
+// chrome://tracing or Perfetto) when KILO_TRACE names a file.
+struct editorStats {
+  // When the first key the next frame answers was read, 0 if none was
+  long long keyns;
+  // When editorDrawFrame was done scrolling
+  long long scrolled;
+  long long scrollns, drawns, writens;
+  // From reading the last key until its frame was written
+  long long latencyns;
+  // Written to the terminal, and times the output buffer had to grow
+  int bytes;
+  int growths;
+  // Arena blocks handed out since the frame before, and the count then
+  long long allocs;
+  long long arenaseen;
+  int overlay;
+  FILE *trace;
+  int traced;
+};
+
+struct editorStats stats = {.overlay = DEBUG};
+
+// Memory that a save in progress may still be reading, freed once it's done
+typedef struct deferredfree {
+  void *p;
+  int cap;
+} deferredfree;
+
+// A save running on a thread of its own, see editorSave. What it writes was
+// snapshotted into `iov` up front, so until it's done the chars of any row
+// from an earlier `gen` must be copied rather than modified or freed.
+struct editorSaveJob {
+  pthread_mutex_t lock;
+  // Guarded by `lock`, the rest is only touched by the main thread or,
+  // between starting the writer and joining it, only read by the writer
+  long long written;
+  int done;
+  int err;
+
+  pthread_t thread;
+  int running;
+  unsigned gen;
+  char *target;
+  struct iovec *iov;
+  int niov, iovcap;
+  long long total;
+  // E.dirty when the snapshot was taken
+  int dirty;
+  deferredfree *deferred;
+  int ndeferred, deferredcap;
+};
+
+struct editorSaveJob savejob = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Every edit is logged as text inserted or deleted at some position, newlines
+// included, so undoing a keystroke costs about as much memory as the keystroke
+// did. Typing in one place keeps growing the same record. The text lives in
+// one buffer in the order it was logged and only the oldest of it is dropped
+// once there's too much, see editorUndoTrim.
+#define UNDO_MAX_TEXT (64 << 20)
+
+enum editorUndoType {
+  UNDO_INSERT,
+  UNDO_DELETE,
+  // An empty row added past the end of the file to start typing on
+  UNDO_NEWROW,
+  // Only ever in the swap file, for an UNDO_NEWROW being undone
+  UNDO_DELROW,
+};
+
+typedef struct undorec {
+  unsigned char type;
+  // Records from the same keypress are undone together
+  unsigned group;
+  int row, col;
+  // Where the text is in undo.text
+  size_t off;
+  int len;
+} undorec;
+
+struct editorUndo {
+  undorec *recs;
+  // Records before `pos` have been done, the ones from there on were undone
+  // and can be redone until something else gets edited
+  int nrecs, reccap, pos;
+  char *text;
+  size_t textlen, textcap;
+  unsigned group;
+  // Whether the last record can still be added to, and where it ends if so
+  int open;
+  int endrow, endcol;
+  // Set while undoing or redoing so the edits made aren't logged again
+  int replaying;
+};
+
+struct editorUndo undo;
+
 /* Prototypes */
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty);
+int editorTakeWakeup();
+int editorWait(int timeout, int others);
+int editorIdleTimeout();
+void editorCheckResize();
+int editorFollowPoll();
+void editorFollowStop();
+void editorSaveFinish(int wait);
+void editorUndoRecord(int type, int row, int col, char *s, int len);
+void editorUndoReset();
+void journalRecord(int type, int row, int col, char *s, int len);
+int editorDurability();
+void editorSyncDir(const char *path);
+long long editorNowMs();
+void pagerClose();
+void pagerOpen();
+void editorStatKey();
+void editorWrapInvalidate();
+void editorUpdateRow(erow *row);
+void editorUpdateRowUtf8(erow *row);
+void editorRowFromLine(erow *row, char *p, char *eol);
+void initEditor();
 
 /* Terminal */
 
 void die(const char *s) {
   // Refer to editorRefreshScreen for what these do
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (!E.batch) {
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+  }
 
   perror(s);
   exit(1);
 }
 
 void disableRawMode() {
+  // Stop bracketing pastes, see enableRawMode
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -135,56 +479,185 @@ void enableRawMode() {
   // Set the character size (CS) to 8 bits per byte
   raw.c_cflag |= (CS8);
 
-  // Update the control characters (CC) to change terminal settings
-  raw.c_cc[VMIN] = 0; // Min num of bytes before `read` can return
-  // Max time before `read` returns, we set to 1/10th of a second
-  raw.c_cc[VTIME] = 1;
+  // Update the control characters (CC) to change terminal settings. `read`
+  // returns straight away with whatever there is, editorWait is what does
+  // the waiting.
+  raw.c_cc[VMIN] = 0;  // Min num of bytes before `read` can return
+  raw.c_cc[VTIME] = 0; // Max time before `read` returns
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // Have the terminal mark where pasted text starts and ends, so that it can
+  // be inserted as a whole rather than a key at a time
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  int nread;
+// How long to wait for the rest of an escape sequence before taking the
+// <esc> to be a key press of its own
+#define ESC_TIMEOUT_MS 100
+// Once a paste has started, how long the terminal can go quiet before we give
+// up on seeing its end, and how much of it we keep at most
+#define PASTE_TIMEOUT_MS 10000
+#define PASTE_MAX (64 << 20)
+
+// Bytes read from the terminal but not decoded into keys yet. We read as much
+// as is available at once, and only go back to `read` once all of it has been
+// used up.
+#define INPUT_BUF_SIZE 4096
+
+struct editorInput {
+  char buf[INPUT_BUF_SIZE];
+  // Free running, `tail - head` bytes are buffered starting at `head`
+  unsigned head, tail;
+  // The text of the last PASTE
+  char *paste;
+  int pastelen, pastecap;
+};
+
+struct editorInput input;
+
+// Adds whatever is available to the ring buffer, as much as there's room for,
+// waiting up to `timeout` ms (-1 for as long as it takes) for something to
+// arrive. With `others` set, anything else editorWait looks out for cuts that
+// short. Returns 0 if nothing arrived.
+int editorFillInput(int timeout, int others) {
+  unsigned at = input.tail % INPUT_BUF_SIZE;
+  unsigned room = INPUT_BUF_SIZE - (input.tail - input.head);
+  if (room > INPUT_BUF_SIZE - at)
+    room = INPUT_BUF_SIZE - at;
+  if (room == 0 || !editorWait(timeout, others))
+    return 0;
+  int nread = read(STDIN_FILENO, &input.buf[at], room);
+  if (nread == -1 && errno != EAGAIN)
+    die("read");
+  // Readable but nothing to read means the terminal went away
+  if (nread == 0) {
+    errno = EIO;
+    die("read");
+  }
+  if (nread == -1)
+    return 0;
+  input.tail += nread;
+  return 1;
+}
+
+// Reads the next byte of a key we're in the middle of decoding, waiting up to
+// `timeout` ms for it
+int editorReadByteWithin(char *c, int timeout) {
+  if (input.head == input.tail && !editorFillInput(timeout, 0))
+    return 0;
+  *c = input.buf[input.head++ % INPUT_BUF_SIZE];
+  return 1;
+}
+
+int editorReadByte(char *c) { return editorReadByteWithin(c, ESC_TIMEOUT_MS); }
+
+// Whether there are more keys to decode without going back to the terminal
+int editorInputPending() { return input.head != input.tail; }
+
+// Takes up to `max` chars from a run of plain text waiting in the buffer
+int editorTakeText(char *s, int max) {
+  int n = 0;
+  while (n < max && input.head != input.tail) {
+    int c = (unsigned char)input.buf[input.head % INPUT_BUF_SIZE];
+    if (!IS_TEXT_KEY(c))
+      break;
+    s[n++] = c;
+    input.head++;
+  }
+  return n;
+}
+
+// Collects everything up to the end of a bracketed paste into `input.paste`.
+// A big paste over a slow link can take a while, so we wait a lot longer
+// between bytes than for an escape sequence. If the end never comes we make
+// do with what we got. Past PASTE_MAX the rest is dropped, but still read
+// up to the end so none of it gets taken for keys.
+int editorReadPaste() {
+  static const char end[] = "\x1b[201~";
+  int endlen = sizeof(end) - 1;
   char c;
+  int dropped = 0;
+  input.pastelen = 0;
+  while (editorReadByteWithin(&c, PASTE_TIMEOUT_MS)) {
+    if (input.pastelen == PASTE_MAX) {
+      // Only the last few bytes are kept, to spot the end by
+      memmove(&input.paste[PASTE_MAX - endlen],
+              &input.paste[PASTE_MAX - endlen + 1], endlen - 1);
+      input.pastelen--;
+      dropped = 1;
+    }
+    if (input.pastelen == input.pastecap) {
+      input.pastecap = input.pastecap ? input.pastecap * 2 : INPUT_BUF_SIZE;
+      input.paste = realloc(input.paste, input.pastecap);
+      if (input.paste == NULL)
+        die("realloc");
+    }
+    input.paste[input.pastelen++] = c;
+    if (c == '~' && input.pastelen >= endlen &&
+        memcmp(&input.paste[input.pastelen - endlen], end, endlen) == 0) {
+      input.pastelen -= endlen;
+      break;
+    }
+  }
+  if (dropped)
+    editorSetStatusMessage("Paste cut short at %d bytes", input.pastelen);
+  return PASTE;
+}
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
-    // If nread is 0, we keep going until we get something
+int editorReadKey() {
+  if (input.head == input.tail && !editorFillInput(editorIdleTimeout(), 1)) {
+    // Woken up by something other than the user, or a timer going off
+    editorTakeWakeup();
+    editorCheckResize();
+    editorFollowPoll();
+    return NO_KEY;
   }
+  char c = input.buf[input.head++ % INPUT_BUF_SIZE];
+  editorStatKey();
 
   // Escape character
   if (c == '\x1b') {
     char seq[3];
 
     // Check if we have enough keys in the escape sequence
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (!editorReadByte(&seq[0]))
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (!editorReadByte(&seq[1]))
       return '\x1b';
 
     if (seq[0] == '[') {
       if ('0' <= seq[1] && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
-        // `PgUp` is sent as `<esc>[5~` and `PgDown` is sent as `<esc>[6~`
+        // A number ended by `~`, e.g. `PgUp` is sent as `<esc>[5~` and
+        // `PgDown` is sent as `<esc>[6~`
+        int n = seq[1] - '0';
+        while (1) {
+          if (!editorReadByte(&seq[2]))
+            return '\x1b';
+          if (seq[2] < '0' || seq[2] > '9')
+            break;
+          if (n < 1000)
+            n = n * 10 + seq[2] - '0';
+        }
         if (seq[2] == '~') {
-          switch (seq[1]) {
-          case '1':
+          switch (n) {
+          case 1:
             return HOME_KEY;
-          case '3':
+          case 3:
             return DEL_KEY;
-          case '4':
+          case 4:
             return END_KEY;
-          case '5':
+          case 5:
             return PAGE_UP;
-          case '6':
+          case 6:
             return PAGE_DOWN;
-          case '7':
+          case 7:
             return HOME_KEY;
-          case '8':
+          case 8:
             return END_KEY;
+          case 200:
+            return editorReadPaste();
           }
         }
       } else {
@@ -219,36 +692,63 @@ int editorReadKey() {
     // Assume user just hit `ESC`
     return '\x1b';
   } else {
-    return c;
+    return (unsigned char)c;
+  }
+}
+
+// Whether what's buffered from `at` on is a cursor position report, of the
+// format \x1b[24;80R where 24 is the height and 80 is the width. Returns its
+// length, 0 if it could still turn out to be one once more arrives, or -1.
+int editorCursorReport(unsigned at, int *rows, int *cols) {
+  int n[2] = {0, 0}, k = 0, digits = 0;
+  for (unsigned j = at; j != input.tail; j++) {
+    char c = input.buf[j % INPUT_BUF_SIZE];
+    if (j - at < 2) {
+      if (c != "\x1b["[j - at])
+        return -1;
+    } else if (isdigit((unsigned char)c) && n[k] < 100000) {
+      n[k] = n[k] * 10 + c - '0';
+      digits++;
+    } else if (c == ';' && k == 0 && digits) {
+      k = 1;
+      digits = 0;
+    } else if (c == 'R' && k == 1 && digits) {
+      *rows = n[0];
+      *cols = n[1];
+      return j - at + 1;
+    } else {
+      return -1;
+    }
   }
+  return 0;
 }
 
+// Keys typed before the report may come ahead of it, so it's picked out of
+// the ring buffer and whatever is around it left there for editorReadKey
 int getCursorPosition(int *rows, int *cols) {
-  char buf[32];
-  unsigned int i = 0;
   // Use the device status report `n` command with an argument of 6 to get the
   // current cursor position
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
     return -1;
 
-  // We expect to be able to read an input of the format \x1b[24;80R or
-  // something of this format, where 24 is the height and 80 is the width
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
-      break;
-    if (buf[i] == 'R')
-      break;
-    i++;
+  unsigned at = input.head;
+  for (;;) {
+    int len = -1;
+    for (; at != input.tail; at++) {
+      len = editorCursorReport(at, rows, cols);
+      if (len != -1)
+        break;
+    }
+    if (len > 0) {
+      // Close the gap it leaves behind
+      for (unsigned j = at + len; j != input.tail; j++)
+        input.buf[(j - len) % INPUT_BUF_SIZE] = input.buf[j % INPUT_BUF_SIZE];
+      input.tail -= len;
+      return 0;
+    }
+    if (!editorFillInput(ESC_TIMEOUT_MS, 0))
+      return -1;
   }
-  // Conveniently replace the `R` with a null-byte
-  buf[i] = '\0';
-
-  if (buf[0] != '\x1b' || buf[1] != '[')
-    return -1;
-  if (sscanf(&buf[2], "%d;%d", rows, cols) != 2)
-    return -1;
-
-  return 0;
 }
 
 // Get screen height and width
@@ -256,7 +756,7 @@ int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
 
   // TIOCGWINSZ stands for Terminal IOCtl Get WINdow SiZe
-  if (1 || ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     // Fallback method to get window size, we move the cursor to the bottom
     // right, i.e. 999 columns (C) to the right, and 999 columns down (B)
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
@@ -269,340 +769,3884 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/* Syntax Highlighting */
+// Lays the screen out for a terminal of the given size
+void editorSetScreenSize(int rows, int cols) {
+  // Reserve two lines for the status and message bars, but always leave at
+  // least one for text
+  E.screenrows = rows > 3 ? rows - 2 : 1;
+  cols = cols > 1 ? cols : 1;
+  if (cols != E.screencols) {
+    E.screencols = cols;
+    editorWrapInvalidate();
+  }
+}
+
+/* Worker pool */
+
+// A set of independent tasks that the pool's threads pick off one at a time,
+// `run(arg, i)` doing the i-th of them
+struct workbatch {
+  void (*run)(void *arg, int task);
+  void *arg;
+  int ntasks;
+  int next;
+  int done;
+  int cancelled;
+};
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+struct workpool {
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when a batch is submitted
+  pthread_cond_t idle; // Signalled when a batch finishes
+  struct workbatch *batch;
+  // Set by background work that wants the screen redrawn, which also writes
+  // to `wakepipe` for editorWait to notice
+  int wakeup;
+  int wakepipe[2];
+};
+
+struct workpool pool = {NULL, 0, PTHREAD_MUTEX_INITIALIZER,
+                        PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                        NULL, 0, {-1, -1}};
+
+void *poolThread(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&pool.lock);
+  while (1) {
+    struct workbatch *b = pool.batch;
+    if (b == NULL || b->next == b->ntasks) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+      continue;
+    }
+
+    int task = b->next++;
+    pthread_mutex_unlock(&pool.lock);
+    b->run(b->arg, task);
+    pthread_mutex_lock(&pool.lock);
 
-  for (int i = 0; i < row->rsize; i++) {
-    if (isdigit(row->render[i])) {
-      row->hl[i] = HL_NUMBER;
+    if (++b->done == b->ntasks) {
+      pool.batch = NULL;
+      pthread_cond_broadcast(&pool.idle);
     }
   }
+  return NULL;
 }
 
-int editorSyntaxToColor(int hl) {
-  // Based on ANSI escape codes
-  // https://en.wikipedia.org/wiki/ANSI_escape_code
-  switch (hl) {
-  case HL_NUMBER:
-    // Foreground red
-    return 31;
-  default:
-    // Foreground white
-    return 37;
-  }
+void poolInit() {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  pool.nthreads = ncpu < 1 ? 1 : ncpu > 64 ? 64 : ncpu;
+  pool.threads = malloc(sizeof(pthread_t) * pool.nthreads);
+  if (pool.threads == NULL)
+    die("malloc");
+  for (int j = 0; j < pool.nthreads; j++)
+    if (pthread_create(&pool.threads[j], NULL, poolThread, NULL) != 0)
+      die("pthread_create");
 }
 
-/* Row operations */
+// Hands a batch to the pool and returns straight away. Only one batch runs
+// at a time, so this waits for whatever batch is still running to finish.
+void poolSubmit(struct workbatch *b, void (*run)(void *, int), void *arg,
+                int ntasks) {
+  if (pool.threads == NULL)
+    poolInit();
+
+  b->run = run;
+  b->arg = arg;
+  b->ntasks = ntasks;
+  b->next = b->done = b->cancelled = 0;
+  if (ntasks == 0)
+    return;
 
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-    }
-    rx++;
-  }
-  return rx;
+  pthread_mutex_lock(&pool.lock);
+  while (pool.batch != NULL)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  pool.batch = b;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-    cur_rx++;
+void poolWait(struct workbatch *b) {
+  pthread_mutex_lock(&pool.lock);
+  while (b->done < b->ntasks)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
 
-    if (cur_rx > rx)
-      return cx;
+// Asks the tasks of `b` to stop early (they have to check poolCancelled) and
+// waits for them to do so
+void poolCancel(struct workbatch *b) {
+  pthread_mutex_lock(&pool.lock);
+  b->cancelled = 1;
+  pthread_mutex_unlock(&pool.lock);
+  poolWait(b);
+}
+
+int poolCancelled(struct workbatch *b) {
+  pthread_mutex_lock(&pool.lock);
+  int cancelled = b->cancelled;
+  pthread_mutex_unlock(&pool.lock);
+  return cancelled;
+}
+
+void editorInitWakeup() {
+  if (pipe(pool.wakepipe) == -1)
+    die("pipe");
+  for (int j = 0; j < 2; j++) {
+    fcntl(pool.wakepipe[j], F_SETFL, O_NONBLOCK);
+    fcntl(pool.wakepipe[j], F_SETFD, FD_CLOEXEC);
   }
+}
 
-  // In case the caller gives us an `rx` that's out of range
-  return cx;
+// Called from background threads that have something new to show
+void editorWakeup() {
+  pthread_mutex_lock(&pool.lock);
+  int pending = pool.wakeup;
+  pool.wakeup = 1;
+  pthread_mutex_unlock(&pool.lock);
+  // One byte in the pipe is enough until the main thread takes it
+  if (!pending)
+    write(pool.wakepipe[1], "", 1);
 }
 
-// Figures out what to render for each row and updates row->render.
-// Also takes care of freeing what was previously there.
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
-      tabs++;
+int editorTakeWakeup() {
+  // Empty the pipe before clearing the flag, so that a wakeup coming in
+  // between leaves a byte behind rather than getting lost
+  char buf[64];
+  while (read(pool.wakepipe[0], buf, sizeof(buf)) > 0)
+    ;
+  pthread_mutex_lock(&pool.lock);
+  int wakeup = pool.wakeup;
+  pool.wakeup = 0;
+  pthread_mutex_unlock(&pool.lock);
+  return wakeup;
+}
 
-  free(row->render);
+/* Row arena */
 
-  // The max number of characters we need for each tab is 8, hence we add 7
-  // more for each tab.
-  row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+int arenaClass(int size) {
+  int c = 0;
+  while ((ARENA_MIN_BLOCK << c) < size)
+    c++;
+  return c;
+}
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+// Returns a block of at least `size` bytes, with its actual size in `*cap`
+void *arenaAlloc(struct arena *a, int size, int *cap) {
+  a->allocs++;
+  if (size > ARENA_MAX_BLOCK) {
+    arenalarge *l = malloc(sizeof(arenalarge) + size);
+    if (l == NULL)
+      die("malloc");
+    l->prev = NULL;
+    l->next = a->large;
+    if (a->large)
+      a->large->prev = l;
+    a->large = l;
+    *cap = size;
+    return l + 1;
+  }
+
+  int c = arenaClass(size);
+  *cap = ARENA_MIN_BLOCK << c;
+  void *p = a->free[c];
+  if (p) {
+    a->free[c] = *(void **)p;
+    return p;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
 
-  editorUpdateSyntax(row);
+  // What's left of the current slab is abandoned, a fresh one is faster to
+  // come by than finding a use for the remainder
+  if (a->end - a->top < *cap) {
+    arenaslab *slab = malloc(ARENA_SLAB_SIZE);
+    if (slab == NULL)
+      die("malloc");
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->top = (char *)(slab + 1);
+    a->end = (char *)slab + ARENA_SLAB_SIZE;
+    a->nslabs++;
+  }
+  p = a->top;
+  a->top += *cap;
+  return p;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+// Gives back a block, `cap` being the size arenaAlloc returned for it
+void arenaFree(struct arena *a, void *p, int cap) {
+  if (p == NULL)
     return;
+  if (cap > ARENA_MAX_BLOCK) {
+    arenalarge *l = (arenalarge *)p - 1;
+    if (l->prev)
+      l->prev->next = l->next;
+    else
+      a->large = l->next;
+    if (l->next)
+      l->next->prev = l->prev;
+    free(l);
+    return;
+  }
+  int c = arenaClass(cap);
+  *(void **)p = a->free[c];
+  a->free[c] = p;
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+// Releases every block at once, whether or not it was freed
+void arenaReset(struct arena *a) {
+  while (a->slabs) {
+    arenaslab *next = a->slabs->next;
+    free(a->slabs);
+    a->slabs = next;
+  }
+  while (a->large) {
+    arenalarge *next = a->large->next;
+    free(a->large);
+    a->large = next;
+  }
+  memset(a->free, 0, sizeof(a->free));
+  a->top = a->end = NULL;
+  a->nslabs = 0;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
+/* Row storage */
+
+// Taken by whatever looks at `row` of a leaf from another thread, as well as
+// by rowtreeExpand when it sets it. Leaves that have been expanded stay that
+// way, and their lines stay where they were until the rows get edited.
+pthread_mutex_t rowtreeLock = PTHREAD_MUTEX_INITIALIZER;
+
+rowleaf *rowtreeNewLeaf() {
+  rowleaf *leaf = malloc(sizeof(rowleaf));
+  if (leaf == NULL)
+    die("malloc");
+  leaf->h.leaf = 1;
+  leaf->h.n = 0;
+  leaf->prev = leaf->next = NULL;
+  leaf->row = NULL;
+  leaf->base = NULL;
+  leaf->off[0] = 0;
+  return leaf;
+}
 
-  editorUpdateRow(&E.row[at]);
+// Turns the lines of `leaf` into rows, if that hasn't been done yet
+void rowtreeExpand(rowleaf *leaf) {
+  if (leaf->row)
+    return;
+  erow *row = malloc(sizeof(erow) * ROWTREE_FANOUT);
+  if (row == NULL)
+    die("malloc");
+  for (int j = 0; j < leaf->h.n; j++)
+    editorRowFromLine(&row[j], leaf->base + leaf->off[j],
+                      leaf->base + leaf->off[j + 1] - 1);
+  // The syntax thread may be going through the states right now
+  pthread_mutex_lock(&rowtreeLock);
+  for (int j = 0; j < leaf->h.n; j++) {
+    row[j].hl_start = leaf->hl_start[j];
+    row[j].hl_state = leaf->hl_state[j];
+  }
+  leaf->row = row;
+  pthread_mutex_unlock(&rowtreeLock);
+}
 
-  E.numrows++;
-  // This gives us an idea of how dirty the file is since we aren't using
-  // a boolean
-  E.dirty++;
+// The chars of line `j` of a leaf that hasn't been expanded
+char *rowtreeLine(rowleaf *leaf, int j, int *len) {
+  char *p = leaf->base + leaf->off[j];
+  int n = leaf->off[j + 1] - leaf->off[j] - 1;
+  while (n > 0 && p[n - 1] == '\r')
+    n--;
+  *len = n;
+  return p;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+// Screen lines row `j` of `leaf` takes up, lines not made into rows yet are
+// taken to fit on one
+int rowtreeHeight(rowleaf *leaf, int j) {
+  return leaf->row ? leaf->row[j].height : 1;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows)
-    return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+rowinner *rowtreeNewInner() {
+  rowinner *in = malloc(sizeof(rowinner));
+  if (in == NULL)
+    die("malloc");
+  in->h.leaf = 0;
+  in->h.n = 0;
+  return in;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  // Allowing going one index more than the row size to allow appending to
-  // a row
-  if (at < 0 || at > row->size)
-    at = row->size;
+int rowtreeCount(rownode *node) {
+  if (node->leaf)
+    return node->n;
+  rowinner *in = (rowinner *)node;
+  int count = 0;
+  for (int i = 0; i < in->h.n; i++)
+    count += in->count[i];
+  return count;
+}
 
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  // Update `render` and `rsize` fields
-  editorUpdateRow(row);
-  E.dirty++;
+// Number of screen lines the rows under `node` take up
+int rowtreeLines(rownode *node) {
+  int lines = 0;
+  if (node->leaf) {
+    rowleaf *leaf = (rowleaf *)node;
+    for (int j = 0; j < leaf->h.n; j++)
+      lines += rowtreeHeight(leaf, j);
+  } else {
+    rowinner *in = (rowinner *)node;
+    for (int i = 0; i < in->h.n; i++)
+      lines += in->lines[i];
+  }
+  return lines;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Finds the leaf holding row `*at` and turns `*at` into an index within it.
+// Asking for one past the last row yields the position after the last leaf's
+// last row.
+rowleaf *rowtreeFind(rownode *node, int *at) {
+  while (!node->leaf) {
+    rowinner *in = (rowinner *)node;
+    int i = 0;
+    while (i < in->h.n - 1 && *at >= in->count[i])
+      *at -= in->count[i++];
+    node = in->child[i];
+  }
+  return (rowleaf *)node;
 }
 
-// Basically do the opposite of editorRowInsertChar
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+void rowtreeAddChild(rowinner *in, int i, rownode *child) {
+  memmove(&in->child[i + 1], &in->child[i],
+          sizeof(rownode *) * (in->h.n - i));
+  memmove(&in->count[i + 1], &in->count[i], sizeof(int) * (in->h.n - i));
+  memmove(&in->lines[i + 1], &in->lines[i], sizeof(int) * (in->h.n - i));
+  in->child[i] = child;
+  in->count[i] = rowtreeCount(child);
+  in->lines[i] = rowtreeLines(child);
+  in->h.n++;
 }
 
-/* Editor operations */
+// Inserts `row` at position `at` under `node`. Returns the new right sibling
+// if `node` was full and had to be split, NULL otherwise.
+rownode *rowtreeInsert(rownode *node, int at, erow *row) {
+  // Nodes that get appended to while already full keep all of their entries
+  // and start an empty sibling, so a file loaded row by row ends up in packed
+  // leaves rather than in half-empty ones.
+  int keep = at == ROWTREE_FANOUT ? ROWTREE_FANOUT : ROWTREE_FANOUT / 2;
+
+  if (node->leaf) {
+    rowleaf *leaf = (rowleaf *)node;
+    rowtreeExpand(leaf);
+    if (leaf->h.n < ROWTREE_FANOUT) {
+      memmove(&leaf->row[at + 1], &leaf->row[at],
+              sizeof(erow) * (leaf->h.n - at));
+      leaf->row[at] = *row;
+      leaf->h.n++;
+      return NULL;
+    }
 
-void editorInsertChar(int c) {
-  // If the user is at the end of the file, we append a newline before
-  // inserting the character
-  if (E.cy == E.numrows)
-    editorInsertRow(E.numrows, "", 0);
+    rowleaf *right = rowtreeNewLeaf();
+    rowtreeExpand(right);
+    right->h.n = ROWTREE_FANOUT - keep;
+    memcpy(right->row, &leaf->row[keep], sizeof(erow) * right->h.n);
+    leaf->h.n = keep;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (right->next)
+      right->next->prev = right;
+    leaf->next = right;
+
+    if (at < keep)
+      rowtreeInsert(node, at, row);
+    else
+      rowtreeInsert((rownode *)right, at - keep, row);
+    return (rownode *)right;
+  }
 
-  // Insert the character and advance the cursor
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  rowinner *in = (rowinner *)node;
+  int i = 0;
+  while (i < in->h.n - 1 && at >= in->count[i])
+    at -= in->count[i++];
+
+  rownode *split = rowtreeInsert(in->child[i], at, row);
+  in->count[i]++;
+  in->lines[i] += row->height;
+  if (split == NULL)
+    return NULL;
+
+  in->count[i] -= rowtreeCount(split);
+  in->lines[i] -= rowtreeLines(split);
+  if (in->h.n < ROWTREE_FANOUT) {
+    rowtreeAddChild(in, i + 1, split);
+    return NULL;
+  }
+
+  keep = i + 1 == ROWTREE_FANOUT ? ROWTREE_FANOUT : ROWTREE_FANOUT / 2;
+  rowinner *right = rowtreeNewInner();
+  right->h.n = ROWTREE_FANOUT - keep;
+  memcpy(right->child, &in->child[keep], sizeof(rownode *) * right->h.n);
+  memcpy(right->count, &in->count[keep], sizeof(int) * right->h.n);
+  memcpy(right->lines, &in->lines[keep], sizeof(int) * right->h.n);
+  in->h.n = keep;
+
+  if (i + 1 < keep)
+    rowtreeAddChild(in, i + 1, split);
+  else
+    rowtreeAddChild(right, i + 1 - keep, split);
+  return (rownode *)right;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
+// Folds child `i + 1` of `in` into child `i`
+void rowtreeMerge(rowinner *in, int i) {
+  rownode *a = in->child[i];
+  rownode *b = in->child[i + 1];
+
+  if (a->leaf) {
+    rowleaf *la = (rowleaf *)a;
+    rowleaf *lb = (rowleaf *)b;
+    rowtreeExpand(la);
+    rowtreeExpand(lb);
+    memcpy(&la->row[la->h.n], lb->row, sizeof(erow) * lb->h.n);
+    free(lb->row);
+    la->next = lb->next;
+    if (la->next)
+      la->next->prev = la;
   } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    // Fetch again as editorInsertRow calls realloc
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    rowinner *ia = (rowinner *)a;
+    rowinner *ib = (rowinner *)b;
+    memcpy(&ia->child[ia->h.n], ib->child, sizeof(rownode *) * ib->h.n);
+    memcpy(&ia->count[ia->h.n], ib->count, sizeof(int) * ib->h.n);
+    memcpy(&ia->lines[ia->h.n], ib->lines, sizeof(int) * ib->h.n);
   }
-  E.cy++;
-  E.cx = 0;
+  a->n += b->n;
+  free(b);
+
+  in->count[i] += in->count[i + 1];
+  in->lines[i] += in->lines[i + 1];
+  memmove(&in->child[i + 1], &in->child[i + 2],
+          sizeof(rownode *) * (in->h.n - i - 2));
+  memmove(&in->count[i + 1], &in->count[i + 2],
+          sizeof(int) * (in->h.n - i - 2));
+  memmove(&in->lines[i + 1], &in->lines[i + 2],
+          sizeof(int) * (in->h.n - i - 2));
+  in->h.n--;
 }
 
-void editorDelChar() {
-  // Nothing to delete past the end of the file
-  if (E.cy == E.numrows)
-    return;
-  // Check if we are at the beginning of the first line
-  if (E.cx == 0 && E.cy == 0)
+// Removes row `at` from under `node` and hands it back through `out`
+void rowtreeDelete(rownode *node, int at, erow *out) {
+  if (node->leaf) {
+    rowleaf *leaf = (rowleaf *)node;
+    rowtreeExpand(leaf);
+    *out = leaf->row[at];
+    memmove(&leaf->row[at], &leaf->row[at + 1],
+            sizeof(erow) * (leaf->h.n - at - 1));
+    leaf->h.n--;
     return;
+  }
 
-  // See if there is a character to the left of the cursor and delete it
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    // We are at the start of some line
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+  rowinner *in = (rowinner *)node;
+  int i = 0;
+  while (i < in->h.n - 1 && at >= in->count[i])
+    at -= in->count[i++];
+
+  rowtreeDelete(in->child[i], at, out);
+  in->count[i]--;
+  in->lines[i] -= out->height;
+
+  // Keep nodes from thinning out by merging a sparse child into a neighbour
+  // whenever they fit in a single node together
+  if (in->child[i]->n < ROWTREE_FANOUT / 4 && in->h.n > 1) {
+    int j = i + 1 < in->h.n ? i : i - 1;
+    if (in->child[j]->n + in->child[j + 1]->n <= ROWTREE_FANOUT)
+      rowtreeMerge(in, j);
   }
 }
 
-/* File i/o */
-
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  for (int j = 0; j < E.numrows; j++) {
-    // +1 for the newlines that we will add at the end of the file
-    totlen += E.row[j].size + 1;
+void rowtreeInsertRow(int at, erow *row) {
+  rownode *split = rowtreeInsert(E.rows, at, row);
+  if (split) {
+    rowinner *root = rowtreeNewInner();
+    rowtreeAddChild(root, 0, E.rows);
+    rowtreeAddChild(root, 1, split);
+    E.rows = (rownode *)root;
   }
-  *buflen = totlen;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p++ = '\n';
+void rowtreeDeleteRow(int at, erow *out) {
+  rowtreeDelete(E.rows, at, out);
+  // Drop roots that are only left with a single child
+  while (!E.rows->leaf && E.rows->n == 1) {
+    rownode *child = ((rowinner *)E.rows)->child[0];
+    free(E.rows);
+    E.rows = child;
   }
-
-  return buf;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+// Frees the nodes under `node`, the rows' memory is left to the arena
+void rowtreeFree(rownode *node) {
+  if (node->leaf) {
+    free(((rowleaf *)node)->row);
+  } else {
+    rowinner *in = (rowinner *)node;
+    for (int i = 0; i < in->h.n; i++)
+      rowtreeFree(in->child[i]);
+  }
+  free(node);
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+// Replaces the (empty) tree with one built bottom up over `nodes`, a run of
+// leaves that are already linked together in order. `nodes` gets used as
+// scratch space for each level on the way up.
+void rowtreeBuild(rownode **nodes, int n) {
+  while (n > 1) {
+    // Spread children evenly, rather than leaving a sparse node at the end
+    int nparents = (n + ROWTREE_FANOUT - 1) / ROWTREE_FANOUT;
+    int k = 0;
+    for (int p = 0; p < nparents; p++) {
+      int to = (long long)n * (p + 1) / nparents;
+      rowinner *in = rowtreeNewInner();
+      for (; k < to; k++)
+        rowtreeAddChild(in, in->h.n, nodes[k]);
+      nodes[p] = (rownode *)in;
+    }
+    n = nparents;
+  }
+  rowtreeFree(E.rows);
+  E.rows = nodes[0];
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// Sets the height of row `at` under `node`, returns how much that changed
+int rowtreeSetHeight(rownode *node, int at, int height) {
+  if (node->leaf) {
+    rowtreeExpand((rowleaf *)node);
+    erow *row = &((rowleaf *)node)->row[at];
+    int change = height - row->height;
+    row->height = height;
+    return change;
+  }
+  rowinner *in = (rowinner *)node;
+  int i = 0;
+  while (i < in->h.n - 1 && at >= in->count[i])
+    at -= in->count[i++];
+  int change = rowtreeSetHeight(in->child[i], at, height);
+  in->lines[i] += change;
+  return change;
+}
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// Number of screen lines taken up by the rows before row `at`
+int rowtreeLineOf(int at) {
+  rownode *node = E.rows;
+  int line = 0;
+  while (!node->leaf) {
+    rowinner *in = (rowinner *)node;
+    int i = 0;
+    for (; i < in->h.n - 1 && at >= in->count[i]; i++) {
+      at -= in->count[i];
+      line += in->lines[i];
+    }
+    node = in->child[i];
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  rowleaf *leaf = (rowleaf *)node;
+  for (int j = 0; j < at && j < leaf->h.n; j++)
+    line += rowtreeHeight(leaf, j);
+  return line;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Finds the row that screen line `*line` is part of, and turns `*line` into
+// which of that row's lines it is. Lines past the last row belong to the
+// position after it.
+int rowtreeRowAtLine(int *line) {
+  rownode *node = E.rows;
+  int at = 0;
+  while (!node->leaf) {
+    rowinner *in = (rowinner *)node;
+    int i = 0;
+    for (; i < in->h.n - 1 && *line >= in->lines[i]; i++) {
+      *line -= in->lines[i];
+      at += in->count[i];
     }
+    node = in->child[i];
   }
+  rowleaf *leaf = (rowleaf *)node;
+  for (int j = 0; j < leaf->h.n && *line >= rowtreeHeight(leaf, j); j++) {
+    *line -= rowtreeHeight(leaf, j);
+    at++;
+  }
+  return at;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
+erow *editorRowAt(int at) {
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+  rowleaf *leaf = rowtreeFind(E.rows, &at);
+  rowtreeExpand(leaf);
+  return &leaf->row[at];
+}
 
-  // FIXME: It would be much safer to write to a temporary file and rename it
-  // to prevent data loss if saving doesn't succeed somehow.
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+// Moves on to the next leaf once the iterator is past the end of this one
+void editorRowIterLeaf(rowiter *it) {
+  while (it->leaf && it->i >= it->leaf->h.n) {
+    it->leaf = it->leaf->next;
+    it->i = 0;
+    if (it->leaf) {
+      pthread_mutex_lock(&rowtreeLock);
+      it->row = it->leaf->row;
+      pthread_mutex_unlock(&rowtreeLock);
     }
-    close(fd);
   }
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void editorRowIterInit(rowiter *it, int at) {
+  it->i = at;
+  it->leaf = rowtreeFind(E.rows, &it->i);
+  pthread_mutex_lock(&rowtreeLock);
+  it->row = it->leaf->row;
+  pthread_mutex_unlock(&rowtreeLock);
 }
 
-/* Find */
+// Returns the next row, or NULL once we've gone past the last one
+erow *editorRowIterNext(rowiter *it) {
+  editorRowIterLeaf(it);
+  if (it->leaf == NULL)
+    return NULL;
+  rowtreeExpand(it->leaf);
+  return &it->leaf->row[it->i++];
+}
 
-void editorFindCallback(char *query, int key) {
-  // Index of the row of the last match
-  static int last_match = -1;
-  // 1 for forwards and -1 for backwards
-  static int direction = 1;
+// Returns the chars of the next row and sets `*len` to how many there are,
+// or returns NULL past the last row. Unlike editorRowIterNext this leaves
+// lines that haven't been made into rows as they are, so it's what to go
+// through the whole file with when nothing gets changed, and what the worker
+// pool can use while the main thread expands leaves.
+char *editorRowIterText(rowiter *it, int *len) {
+  editorRowIterLeaf(it);
+  if (it->leaf == NULL)
+    return NULL;
+  int j = it->i++;
+  if (it->row == NULL)
+    return rowtreeLine(it->leaf, j, len);
+  *len = it->row[j].size;
+  return it->row[j].chars;
+}
 
-  if (key == '\r' || key == '\x1b') {
-    // Reset to initial state for next call
-    last_match = -1;
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
-  }
+/* Syntax Highlighting */
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
+#define IS_DIGIT(c) ((unsigned char)((c) - '0') <= 9)
 
-  for (int i = 0; i < E.numrows; i++) {
-    current += direction;
+// Keyword tables have KEYWORD_SLOTS entries, each keyword in the slot given
+// by this hash. The multiplier and table size were picked so that no two C
+// keywords collide, anything added has to be checked for that too.
+#define KEYWORD_SLOTS 128
+#define KEYWORD_MAX_LEN 8
 
-    // We support wrapping around (both sides)
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-
-      // A hack so that editorScroll will put the matching line at the top
-      // at the next refresh
-      E.rowoff = E.numrows;
-      break;
+int editorKeywordHash(const char *s, int len) {
+  return (5 * ((unsigned char)s[0] + (unsigned char)s[len - 1]) + len) &
+         (KEYWORD_SLOTS - 1);
+}
+
+const keyword C_keywords[KEYWORD_SLOTS] = {
+    [6] = {"break", HL_KEYWORD1},     [8] = {"short", HL_KEYWORD2},
+    [9] = {"struct", HL_KEYWORD1},    [12] = {"inline", HL_KEYWORD1},
+    [13] = {"if", HL_KEYWORD1},       [20] = {"auto", HL_KEYWORD1},
+    [30] = {"enum", HL_KEYWORD1},     [33] = {"do", HL_KEYWORD1},
+    [35] = {"long", HL_KEYWORD2},     [37] = {"extern", HL_KEYWORD1},
+    [45] = {"char", HL_KEYWORD2},     [50] = {"goto", HL_KEYWORD1},
+    [52] = {"static", HL_KEYWORD1},   [56] = {"const", HL_KEYWORD1},
+    [57] = {"signed", HL_KEYWORD2},   [59] = {"for", HL_KEYWORD1},
+    [63] = {"default", HL_KEYWORD1},  [67] = {"sizeof", HL_KEYWORD1},
+    [69] = {"unsigned", HL_KEYWORD2}, [70] = {"void", HL_KEYWORD2},
+    [71] = {"float", HL_KEYWORD2},    [73] = {"typedef", HL_KEYWORD1},
+    [77] = {"switch", HL_KEYWORD1},   [79] = {"volatile", HL_KEYWORD1},
+    [81] = {"while", HL_KEYWORD1},    [84] = {"int", HL_KEYWORD2},
+    [102] = {"return", HL_KEYWORD1},  [108] = {"case", HL_KEYWORD1},
+    [112] = {"continue", HL_KEYWORD1}, [115] = {"double", HL_KEYWORD2},
+    [116] = {"union", HL_KEYWORD1},   [118] = {"else", HL_KEYWORD1},
+    [124] = {"register", HL_KEYWORD1},
+};
+
+int editorIsSeparator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|^!?:", c);
+}
+
+// What kind of keyword s[0, len) is, or HL_NORMAL
+int editorKeyword(struct editorSyntax *syntax, char *s, int len) {
+  if (len > KEYWORD_MAX_LEN)
+    return HL_NORMAL;
+  const keyword *kw = &syntax->keywords[editorKeywordHash(s, len)];
+  if (kw->word && strncmp(kw->word, s, len) == 0 && kw->word[len] == '\0')
+    return kw->hl;
+  return HL_NORMAL;
+}
+
+int editorHighlightC(struct editorSyntax *syntax, char *s, int len,
+                     unsigned char *hl, int state) {
+  // Marks s[from, to) as `type` when we're filling in `hl`
+#define MARK(from, to, type)                                                   \
+  do {                                                                         \
+    if (hl)                                                                    \
+      memset(&hl[from], type, (to) - (from));                                  \
+  } while (0)
+
+  int quote = 0;
+  int j = 0;
+  while (j < len) {
+    char c = s[j];
+    char next = j + 1 < len ? s[j + 1] : '\0';
+
+    if (state == HLS_COMMENT) {
+      int start = j;
+      while (j < len && !(s[j] == '*' && j + 1 < len && s[j + 1] == '/'))
+        j++;
+      if (j < len) {
+        j += 2;
+        state = HLS_NORMAL;
+      }
+      MARK(start, j, HL_MLCOMMENT);
+    } else if (quote) {
+      // Skip over whatever is escaped
+      int end = c == '\\' && j + 1 < len ? j + 2 : j + 1;
+      MARK(j, end, HL_STRING);
+      if (c == quote)
+        quote = 0;
+      j = end;
+    } else if (c == '/' && next == '/') {
+      MARK(j, len, HL_COMMENT);
+      j = len;
+    } else if (c == '/' && next == '*') {
+      MARK(j, j + 2, HL_MLCOMMENT);
+      j += 2;
+      state = HLS_COMMENT;
+    } else if (c == '"' || c == '\'') {
+      MARK(j, j + 1, HL_STRING);
+      quote = c;
+      j++;
+    } else if (editorIsSeparator(c)) {
+      MARK(j, j + 1, HL_NORMAL);
+      j++;
+    } else {
+      // A whole word, which is a number if it starts with a digit. Decimal
+      // points are separators but belong to the number.
+      int start = j;
+      while (j < len && (!editorIsSeparator(s[j]) ||
+                         (s[j] == '.' && IS_DIGIT(s[start]))))
+        j++;
+      int type = IS_DIGIT(c) ? HL_NUMBER
+                             : editorKeyword(syntax, &s[start], j - start);
+      MARK(start, j, type);
+    }
+  }
+  return state;
+#undef MARK
+}
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
+
+struct editorSyntax HLDB[] = {
+    {"c", C_HL_extensions, editorHighlightC, C_keywords},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+// Picks the highlighter to use going by the filename
+void editorSelectSyntax() {
+  E.syntax = NULL;
+  E.hl_valid = 0;
+  if (E.filename == NULL)
+    return;
+
+  char *ext = strrchr(E.filename, '.');
+  for (unsigned j = 0; j < HLDB_ENTRIES; j++) {
+    for (char **m = HLDB[j].filematch; *m; m++) {
+      int is_ext = (*m)[0] == '.';
+      if ((is_ext && ext && strcmp(ext, *m) == 0) ||
+          (!is_ext && strstr(E.filename, *m))) {
+        E.syntax = &HLDB[j];
+        return;
+      }
+    }
+  }
+}
+
+// Rows the background job does between checking in, see editorSyntaxThread
+#define SYNTAX_BATCH_ROWS 4096
+
+// Works out the states of rows past E.hl_valid on a thread of its own, so
+// that jumping far into a big file doesn't mean waiting for every row above
+// to be looked at. While it runs it owns the `hl_start` and `hl_state` of
+// the rows from `from` on, and as it walks the row tree nothing may be
+// inserted or deleted either, hence editorSyntaxInvalidate stopping it.
+struct editorSyntaxJob {
+  pthread_mutex_t lock;
+  // Guarded by `lock`. Rows before `progress` are done, and the main thread
+  // gets woken up once that reaches `wakeat`.
+  int progress;
+  int wakeat;
+  int cancelled;
+  int finished;
+
+  pthread_t thread;
+  int running;
+  // The rows to go through and the state the first of them starts in
+  int from, to;
+  int state;
+};
+
+struct editorSyntaxJob hljob = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// The state rows from `at` (which must be at most E.hl_valid) start in
+int editorSyntaxStateAt(int at) {
+  return at > 0 ? editorRowAt(at - 1)->hl_state : HLS_NORMAL;
+}
+
+// Brings the states of rows [from, at) up to date, `it` being at `from` and
+// the first of them starting in `state`. A row is only looked at again if it
+// changed or starts in a different state than before, so an edit that
+// doesn't e.g. open or close a comment costs no more than the rows it
+// touched. Returns the state row `at` starts in.
+//
+// Leaves that haven't been expanded keep the states themselves. Going
+// through one of those keeps hold of rowtreeLock, so that the main thread
+// can't make rows out of them in the middle.
+int editorSyntaxScan(rowiter *it, int from, int at, int state) {
+  while (from < at) {
+    editorRowIterLeaf(it);
+    rowleaf *leaf = it->leaf;
+    int end = at - from < leaf->h.n - it->i ? at : from + leaf->h.n - it->i;
+    pthread_mutex_lock(&rowtreeLock);
+    if (leaf->row) {
+      pthread_mutex_unlock(&rowtreeLock);
+      for (; from < end; from++) {
+        erow *row = &leaf->row[it->i++];
+        if (row->hl_start != state) {
+          row->hl_start = state;
+          row->hl_state = E.syntax->highlight(E.syntax, row->chars,
+                                              row->size, NULL, state);
+        }
+        state = row->hl_state;
+      }
+    } else {
+      for (; from < end; from++) {
+        int j = it->i++;
+        if (leaf->hl_start[j] != state) {
+          int len;
+          char *s = rowtreeLine(leaf, j, &len);
+          leaf->hl_start[j] = state;
+          leaf->hl_state[j] =
+              E.syntax->highlight(E.syntax, s, len, NULL, state);
+        }
+        state = leaf->hl_state[j];
+      }
+      pthread_mutex_unlock(&rowtreeLock);
+    }
+  }
+  return state;
+}
+
+void *editorSyntaxThread(void *unused) {
+  (void)unused;
+#ifdef SCHED_IDLE
+  // Stay out of the way of everything else
+  struct sched_param param = {0};
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+  rowiter it;
+  editorRowIterInit(&it, hljob.from);
+  int at = hljob.from, state = hljob.state;
+  int stop = 0;
+  while (!stop) {
+    int end = hljob.to - at > SYNTAX_BATCH_ROWS ? at + SYNTAX_BATCH_ROWS
+                                                 : hljob.to;
+    state = editorSyntaxScan(&it, at, end, state);
+    at = end;
+
+    pthread_mutex_lock(&hljob.lock);
+    hljob.progress = at;
+    hljob.finished = at == hljob.to;
+    stop = hljob.finished || hljob.cancelled;
+    int wake = hljob.wakeat >= 0 && (at >= hljob.wakeat || hljob.finished);
+    if (wake)
+      hljob.wakeat = -1;
+    pthread_mutex_unlock(&hljob.lock);
+    if (wake)
+      editorWakeup();
+  }
+  return NULL;
+}
+
+// Takes on what the background job got done so far
+void editorSyntaxCollect() {
+  if (!hljob.running)
+    return;
+  pthread_mutex_lock(&hljob.lock);
+  int progress = hljob.progress;
+  int finished = hljob.finished;
+  pthread_mutex_unlock(&hljob.lock);
+  if (progress > E.hl_valid)
+    E.hl_valid = progress;
+  if (finished) {
+    pthread_join(hljob.thread, NULL);
+    hljob.running = 0;
+  }
+}
+
+void editorSyntaxStop() {
+  if (!hljob.running)
+    return;
+  pthread_mutex_lock(&hljob.lock);
+  hljob.cancelled = 1;
+  pthread_mutex_unlock(&hljob.lock);
+  pthread_join(hljob.thread, NULL);
+  hljob.running = 0;
+  if (hljob.progress > E.hl_valid)
+    E.hl_valid = hljob.progress;
+}
+
+// Gets the background job going on whatever rows aren't up to date, if it
+// isn't already, and has it wake us up once it's done up to row `wakeat`
+// (unless that's -1)
+void editorSyntaxStart(int wakeat) {
+  if (hljob.running) {
+    pthread_mutex_lock(&hljob.lock);
+    hljob.wakeat = wakeat;
+    pthread_mutex_unlock(&hljob.lock);
+    return;
+  }
+  if (E.syntax == NULL || E.hl_valid >= E.numrows)
+    return;
+
+  hljob.from = E.hl_valid;
+  hljob.to = E.numrows;
+  hljob.state = editorSyntaxStateAt(E.hl_valid);
+  hljob.progress = E.hl_valid;
+  hljob.wakeat = wakeat;
+  hljob.cancelled = hljob.finished = 0;
+  if (pthread_create(&hljob.thread, NULL, editorSyntaxThread, NULL) != 0)
+    die("pthread_create");
+  hljob.running = 1;
+}
+
+// Rows from `at` on are about to change and might highlight differently
+void editorSyntaxInvalidate(int at) {
+  editorSyntaxStop();
+  if (at < E.hl_valid)
+    E.hl_valid = at < 0 ? 0 : at;
+}
+
+// Brings the states of rows [0, at) up to date right away
+void editorSyntaxUpTo(int at) {
+  if (E.syntax == NULL)
+    return;
+  if (at > E.numrows)
+    at = E.numrows;
+  if (E.hl_valid >= at)
+    return;
+
+  editorSyntaxStop();
+  rowiter it;
+  editorRowIterInit(&it, E.hl_valid);
+  editorSyntaxScan(&it, E.hl_valid, at, editorSyntaxStateAt(E.hl_valid));
+  E.hl_valid = at;
+}
+
+// The highlighting to draw row `at` with, or NULL to draw it plain because
+// we don't know yet what state it starts in
+unsigned char *editorRowHighlight(erow *row, int at) {
+  if (E.syntax == NULL)
+    return row->hl;
+  if (at >= E.hl_valid)
+    return NULL;
+  if (row->hl_drawn != row->hl_start) {
+    E.syntax->highlight(E.syntax, row->render, row->rsize, row->hl,
+                        row->hl_start);
+    row->hl_drawn = row->hl_start;
+  }
+  return row->hl;
+}
+
+int editorSyntaxToColor(int hl) {
+  // Based on ANSI escape codes
+  // https://en.wikipedia.org/wiki/ANSI_escape_code
+  switch (hl) {
+  case HL_COMMENT:
+  case HL_MLCOMMENT:
+    // Foreground cyan
+    return 36;
+  case HL_KEYWORD1:
+    // Foreground yellow
+    return 33;
+  case HL_KEYWORD2:
+    // Foreground green
+    return 32;
+  case HL_STRING:
+    // Foreground magenta
+    return 35;
+  case HL_NUMBER:
+    // Foreground red
+    return 31;
+  default:
+    // Foreground white
+    return 37;
+  }
+}
+
+/* Unicode */
+
+typedef struct utf8range {
+  int from, to;
+} utf8range;
+
+// Codepoints that take up no column of their own: combining marks, zero
+// width spaces and joiners, and variation selectors
+static const utf8range utf8ZeroWidth[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf},
+    {0x05c1, 0x05c2}, {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x0670, 0x0670}, {0x06d6, 0x06dc}, {0x06df, 0x06e4},
+    {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0903}, {0x093a, 0x094f},
+    {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a},
+    {0x0e47, 0x0e4e}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+    {0x2028, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0x302a, 0x302f},
+    {0x3099, 0x309a}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff},
+    {0x1f3fb, 0x1f3ff}, {0xe0000, 0xe0fff},
+};
+
+// East Asian wide and fullwidth codepoints, and emoji, which take two
+static const utf8range utf8Wide[] = {
+    {0x1100, 0x115f},   {0x231a, 0x231b},   {0x2329, 0x232a},
+    {0x23e9, 0x23ec},   {0x23f0, 0x23f0},   {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267f, 0x267f},   {0x2693, 0x2693},   {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},   {0x26bd, 0x26be},   {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},   {0x26d4, 0x26d4},   {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},   {0x26f5, 0x26f5},   {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},   {0x2705, 0x2705},   {0x270a, 0x270b},
+    {0x2728, 0x2728},   {0x274c, 0x274c},   {0x274e, 0x274e},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27b0, 0x27b0},   {0x27bf, 0x27bf},   {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},   {0x2b55, 0x2b55},   {0x2e80, 0x303e},
+    {0x3041, 0x3247},   {0x3250, 0x4dbf},   {0x4e00, 0xa4cf},
+    {0xa960, 0xa97f},   {0xac00, 0xd7a3},   {0xf900, 0xfaff},
+    {0xfe10, 0xfe19},   {0xfe30, 0xfe6f},   {0xff00, 0xff60},
+    {0xffe0, 0xffe6},   {0x16fe0, 0x16fe4}, {0x17000, 0x18cff},
+    {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f202},
+    {0x1f210, 0x1f23b}, {0x1f240, 0x1f248}, {0x1f250, 0x1f251},
+    {0x1f260, 0x1f265}, {0x1f300, 0x1f320}, {0x1f32d, 0x1f335},
+    {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4},
+    {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc},
+    {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567},
+    {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc},
+    {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6d7}, {0x1f6eb, 0x1f6ec},
+    {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f93a},
+    {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faff},
+    {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+};
+
+int utf8InRanges(const utf8range *ranges, int n, int cp) {
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ranges[mid].to < cp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && ranges[lo].from <= cp;
+}
+
+// Columns codepoint `cp` takes up on the terminal
+int utf8Width(int cp) {
+  if (cp < 0x300)
+    return 1;
+  if (utf8InRanges(utf8ZeroWidth,
+                   sizeof(utf8ZeroWidth) / sizeof(utf8ZeroWidth[0]), cp))
+    return 0;
+  if (cp >= 0x1100 &&
+      utf8InRanges(utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0]), cp))
+    return 2;
+  return 1;
+}
+
+// Decodes the UTF-8 sequence at the start of the `len` bytes at `s` into
+// `*cp` and returns its length, or 0 if it isn't a valid one
+int utf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  }
+  int n, min;
+  if ((u[0] & 0xe0) == 0xc0) {
+    n = 2;
+    min = 0x80;
+    *cp = u[0] & 0x1f;
+  } else if ((u[0] & 0xf0) == 0xe0) {
+    n = 3;
+    min = 0x800;
+    *cp = u[0] & 0x0f;
+  } else if ((u[0] & 0xf8) == 0xf0) {
+    n = 4;
+    min = 0x10000;
+    *cp = u[0] & 0x07;
+  } else {
+    return 0;
+  }
+  if (n > len)
+    return 0;
+  for (int j = 1; j < n; j++) {
+    if ((u[j] & 0xc0) != 0x80)
+      return 0;
+    *cp = *cp << 6 | (u[j] & 0x3f);
+  }
+  // Overlong forms, surrogates and anything past the last codepoint
+  if (*cp < min || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+    return 0;
+  return n;
+}
+
+// Returns how many of the `len` bytes at `s` make up the next char as the
+// user sees it, and sets `*width` to the columns it takes. That's a
+// codepoint along with any zero width ones after it, and whatever a zero
+// width joiner ties on. A byte that isn't valid UTF-8 counts as a char of
+// its own. Spaces and control chars don't take marks, so they stay one
+// column each whether a tab was expanded into them or not.
+int utf8Grapheme(const char *s, int len, int *width) {
+  *width = 1;
+  unsigned char c = s[0];
+  if (c < 0x80 && (len == 1 || !(s[1] & 0x80)))
+    return 1;
+
+  int cp, n = utf8Decode(s, len, &cp);
+  if (n == 0)
+    n = 1;
+  else if (utf8Width(cp) == 2)
+    *width = 2;
+  if (c <= ' ')
+    return n;
+  while (n < len && (s[n] & 0x80)) {
+    int m = utf8Decode(&s[n], len - n, &cp);
+    if (m == 0 || utf8Width(cp) != 0)
+      break;
+    n += m;
+    if (cp == 0x200d && n < len && (s[n] & 0x80))
+      n += utf8Decode(&s[n], len - n, &cp);
+  }
+  return n;
+}
+
+// Whether all `len` bytes at `s` are ASCII, checked a vector at a time
+int utf8IsAscii(const char *s, int len) {
+  int j = 0;
+#if defined(__AVX2__)
+  for (; j + 32 <= len; j += 32)
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((__m256i *)&s[j])))
+      return 0;
+#elif defined(__SSE2__)
+  for (; j + 16 <= len; j += 16)
+    if (_mm_movemask_epi8(_mm_loadu_si128((__m128i *)&s[j])))
+      return 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; j + 16 <= len; j += 16)
+    if (vmaxvq_u8(vld1q_u8((uint8_t *)&s[j])) & 0x80)
+      return 0;
+#endif
+  for (; j < len; j++)
+    if (s[j] & 0x80)
+      return 0;
+  return 1;
+}
+
+/* Row operations */
+
+// Index of the first tab at or past `cx`
+int editorRowTabAfter(erow *row, int cx) {
+  int lo = 0, hi = row->ntabs;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->tabs[mid].cx < cx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Rendered rows know where their tabs are, and everything between two tabs
+// maps across one to one. So converting between `chars` and `render`
+// positions is a binary search, only rows that were never rendered are
+// walked from the start. So are rows with UTF-8 in them, where `rx` counts
+// columns on screen rather than bytes of `render`.
+int editorRowCxToRx(erow *row, int cx) {
+  if (row->render && !row->utf8) {
+    int k = editorRowTabAfter(row, cx);
+    if (k == 0)
+      return cx;
+    return row->tabs[k - 1].rx + cx - row->tabs[k - 1].cx - 1;
+  }
+
+  int rx = 0;
+  for (int j = 0; j < cx;) {
+    if (row->chars[j] == '\t') {
+      rx += KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+      j++;
+    } else {
+      int width;
+      j += utf8Grapheme(&row->chars[j], row->size - j, &width);
+      rx += width;
+    }
+  }
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  if (row->render && !row->utf8) {
+    // Find the first tab that ends past `rx`
+    int lo = 0, hi = row->ntabs;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (row->tabs[mid].rx <= rx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    int cx = lo ? row->tabs[lo - 1].cx + 1 + rx - row->tabs[lo - 1].rx : rx;
+    // `rx` may be somewhere within that tab
+    if (lo < row->ntabs && cx > row->tabs[lo].cx)
+      cx = row->tabs[lo].cx;
+    return cx < row->size ? cx : row->size;
+  }
+
+  int cur_rx = 0;
+  int cx;
+  for (cx = 0; cx < row->size;) {
+    int width, len = 1;
+    if (row->chars[cx] == '\t')
+      width = KILO_TAB_STOP - (cur_rx % KILO_TAB_STOP);
+    else
+      len = utf8Grapheme(&row->chars[cx], row->size - cx, &width);
+    cur_rx += width;
+
+    if (cur_rx > rx)
+      return cx;
+    cx += len;
+  }
+
+  // In case the caller gives us an `rx` that's out of range
+  return cx;
+}
+
+// Where the char the cursor would be on at `cx` starts. ASCII always starts
+// a char, so at most the run of UTF-8 before `cx` gets walked.
+int editorRowCharStart(erow *row, int cx) {
+  if (cx <= 0 || cx >= row->size || !(row->chars[cx] & 0x80))
+    return cx;
+  int j = cx;
+  while (j > 0 && (row->chars[j - 1] & 0x80))
+    j--;
+  if (j > 0)
+    j--;
+  int start = j;
+  while (j <= cx) {
+    int width;
+    start = j;
+    j += row->chars[j] == '\t'
+             ? 1
+             : utf8Grapheme(&row->chars[j], row->size - j, &width);
+  }
+  return start;
+}
+
+// The start of the char after the one at `cx`, and before it
+int editorRowNextChar(erow *row, int cx) {
+  if (cx >= row->size)
+    return row->size;
+  int width;
+  return row->chars[cx] == '\t'
+             ? cx + 1
+             : cx + utf8Grapheme(&row->chars[cx], row->size - cx, &width);
+}
+
+int editorRowPrevChar(erow *row, int cx) {
+  return cx > 0 ? editorRowCharStart(row, cx - 1) : 0;
+}
+
+// Where in `render` the char at column `rx` starts. If a wide char covers
+// `rx` along with the column before, it's the char after that and `*pad`
+// says how many columns to skip to get to it.
+int editorRowRenderAt(erow *row, int rx, int *pad) {
+  *pad = 0;
+  if (!row->utf8)
+    return rx;
+  int col = 0, j = 0;
+  while (j < row->rsize && col < rx) {
+    int width;
+    j += utf8Grapheme(&row->render[j], row->rsize - j, &width);
+    col += width;
+  }
+  *pad = col > rx ? col - rx : 0;
+  return j;
+}
+
+// Lays a UTF-8 row out the way wrapping shows it, where a wide char that
+// doesn't fit at the end of a line starts the next one instead. Walks
+// `render` up to column `rx` or the first char on line `seg`, whichever
+// comes first, and returns where in `render` that is. `*line` and `*x` are
+// set to where on screen it lands, `*col` to the column it's at in the row.
+int editorRowLayout(erow *row, int rx, int seg, int *line, int *x, int *col) {
+  int j = 0;
+  *line = *x = *col = 0;
+  while (j < row->rsize) {
+    int width, len = utf8Grapheme(&row->render[j], row->rsize - j, &width);
+    if (*x + width > E.screencols) {
+      (*line)++;
+      *x = 0;
+    }
+    if (*col >= rx || *line >= seg)
+      break;
+    *x += width;
+    *col += width;
+    j += len;
+  }
+  return j;
+}
+
+// Where in `render` screen line `seg` of a wrapped row starts
+int editorRowLineStart(erow *row, int seg) {
+  if (!row->utf8)
+    return seg * E.screencols;
+  int line, x, col;
+  return editorRowLayout(row, INT_MAX, seg, &line, &x, &col);
+}
+
+// The column screen line `seg` of a wrapped row starts at, or the width of
+// the row if it doesn't have that many
+int editorRowLineCol(erow *row, int seg) {
+  if (!row->utf8) {
+    int col = seg * E.screencols;
+    return col < row->rsize ? col : row->rsize;
+  }
+  int line, x, col;
+  editorRowLayout(row, INT_MAX, seg, &line, &x, &col);
+  return col;
+}
+
+// Which screen line of a wrapped row column `rx` is on, with `*x` set to
+// the column on screen. The end of a row that fills its last line is on
+// that line, just past the edge.
+int editorRowLineOf(erow *row, int rx, int *x) {
+  if (!row->utf8) {
+    int line = rx < row->rsize || rx == 0 ? rx / E.screencols
+                                          : (rx - 1) / E.screencols;
+    *x = rx - line * E.screencols;
+    return line;
+  }
+  int line, col;
+  editorRowLayout(row, rx, INT_MAX, &line, x, &col);
+  return line;
+}
+
+// How wide the row is on screen, without having to render it
+int editorRowWidth(erow *row) {
+  if (row->render && !row->utf8)
+    return row->rsize;
+  if (memchr(row->chars, '\t', row->size) == NULL &&
+      utf8IsAscii(row->chars, row->size))
+    return row->size;
+  return editorRowCxToRx(row, row->size);
+}
+
+// Lines the row takes up when wrapped at the edge of the screen. Rows with
+// UTF-8 in them have to be laid out to tell, so they get rendered for it.
+int editorRowHeight(erow *row) {
+  if (row->render == NULL && !utf8IsAscii(row->chars, row->size))
+    editorUpdateRow(row);
+  if (row->render && row->utf8) {
+    int x;
+    return editorRowLineOf(row, INT_MAX, &x) + 1;
+  }
+  int width = editorRowWidth(row);
+  return width > E.screencols ? (width + E.screencols - 1) / E.screencols : 1;
+}
+
+// Brings the height of row `at` up to date after it changed. Heights are
+// only kept up while wrapping, and only for rows that have been near the
+// screen since it was last turned on or the width changed.
+void editorWrapUpdate(int at) {
+  if (!E.wrap || at < 0 || at >= E.numrows)
+    return;
+  erow *row = editorRowAt(at);
+  row->wrapgen = E.wrapgen;
+  rowtreeSetHeight(E.rows, at, editorRowHeight(row));
+}
+
+// Has every row's height worked out again, once wrapping gets turned on or
+// the width changes. Rather than a pass over the whole file, rows catch up as
+// they come near the screen. Until then the line counts in the row tree are
+// off for the rest, but only scrolling and paging go by them and they only
+// look as far as editorWrapView keeps up to date.
+void editorWrapInvalidate() { E.wrapgen++; }
+
+// Brings the heights of rows [from, to) up to date where they're stale
+void editorWrapRange(int from, int to) {
+  from = from > 0 ? from : 0;
+  to = to < E.numrows ? to : E.numrows;
+  if (from >= to)
+    return;
+  rowiter it;
+  editorRowIterInit(&it, from);
+  for (int at = from; at < to; at++) {
+    erow *row = editorRowIterNext(&it);
+    if (row->wrapgen == E.wrapgen)
+      continue;
+    row->wrapgen = E.wrapgen;
+    int change = rowtreeSetHeight(E.rows, at, editorRowHeight(row));
+    // Rows above the screen getting taller moves the top line down just as
+    // much, which isn't the view scrolling
+    if (at < E.rowoff)
+      E.frame_rowoff += change;
+  }
+}
+
+// Keeps the heights up to date for a screen's worth of rows either side of
+// the cursor and of the top of the screen. Every row from the top to the
+// cursor is then among them, as is every line paging can get to.
+void editorWrapView() {
+  editorWrapRange(E.cy - E.screenrows, E.cy + E.screenrows + 1);
+  editorWrapRange(E.rowoff - E.screenrows, E.rowoff + 2 * E.screenrows);
+}
+
+// Extra room at the end of `render` and `hl` so the vector loops below can
+// always store a whole block, even when only part of it is used
+#define RENDER_SLACK 32
+
+// Makes sure `render` and `hl` can hold `len` chars plus the slack, growing
+// them at least twofold when they can't. Only the first `keep` columns are
+// carried over when they move.
+void editorRowReserveRender(erow *row, int len, int keep) {
+  int need = len + RENDER_SLACK + 1;
+  if (need <= row->rcap)
+    return;
+  int cap = row->rcap * 2 > need ? row->rcap * 2 : need;
+  int blockcap;
+  char *block = arenaAlloc(&E.arena, cap * 2, &blockcap);
+  cap = blockcap / 2;
+  if (row->render) {
+    memcpy(block, row->render, keep);
+    memcpy(block + cap, row->hl, keep);
+    arenaFree(&E.arena, row->render, row->rcap * 2);
+  }
+  row->render = block;
+  row->hl = (unsigned char *)block + cap;
+  row->rcap = cap;
+}
+
+// Whether a save in progress is still going to write out `chars` as they are
+int editorRowFrozen(erow *row) {
+  return row->ccap && savejob.running && row->gen != savejob.gen;
+}
+
+void editorRowFreeChars(erow *row) {
+  if (row->ccap == 0)
+    return;
+  if (!editorRowFrozen(row)) {
+    arenaFree(&E.arena, row->chars, row->ccap);
+    return;
+  }
+  if (savejob.ndeferred == savejob.deferredcap) {
+    savejob.deferredcap = savejob.deferredcap ? savejob.deferredcap * 2 : 64;
+    savejob.deferred = realloc(savejob.deferred,
+                               sizeof(deferredfree) * savejob.deferredcap);
+    if (savejob.deferred == NULL)
+      die("realloc");
+  }
+  savejob.deferred[savejob.ndeferred].p = row->chars;
+  savejob.deferred[savejob.ndeferred++].cap = row->ccap;
+}
+
+// Makes sure `chars` has room for `len` chars and the NUL
+void editorRowReserveChars(erow *row, int len) {
+  if (len + 1 <= row->ccap)
+    return;
+  int cap = row->ccap * 2 > len + 1 ? row->ccap * 2 : len + 1;
+  char *chars = arenaAlloc(&E.arena, cap, &cap);
+  memcpy(chars, row->chars, row->size + 1);
+  editorRowFreeChars(row);
+  row->chars = chars;
+  row->ccap = cap;
+  row->gen = savejob.gen;
+}
+
+// Makes room for `n` tabs in the tab index
+void editorRowReserveTabs(erow *row, int n) {
+  if (n <= row->tabcap)
+    return;
+  int cap = row->tabcap * 2 > n ? row->tabcap * 2 : n;
+  int bytes;
+  tabstop *tabs = arenaAlloc(&E.arena, sizeof(tabstop) * cap, &bytes);
+  if (row->ntabs)
+    memcpy(tabs, row->tabs, sizeof(tabstop) * row->ntabs);
+  arenaFree(&E.arena, row->tabs, sizeof(tabstop) * row->tabcap);
+  row->tabs = tabs;
+  row->tabcap = bytes / sizeof(tabstop);
+}
+
+// Figures out what to render for each row and updates row->render, marking
+// digits in row->hl as it goes. That's all the highlighting there is without
+// a syntax, with one `hl` gets filled in again by editorRowHighlight.
+// Whatever was previously allocated gets reused if it is big enough.
+//
+// This is a single pass over `chars`. Blocks without tabs are copied and
+// classified a vector at a time, and only tabs are handled one by one. The
+// first byte that isn't ASCII hands the row over to editorUpdateRowUtf8.
+void editorUpdateRow(erow *row) {
+  // Tabs make the render longer than `chars`, if we see more of them than we
+  // have room for the buffers get doubled
+  editorRowReserveRender(row, row->size, 0);
+  int cap = row->rcap;
+  char *render = row->render;
+  unsigned char *hl = row->hl;
+
+  int idx = 0;
+  int j = 0;
+  row->ntabs = 0;
+  while (j < row->size) {
+    // Where the vector code stopped and we have to look at chars one by one
+    int stop = j + 1;
+
+#if defined(__AVX2__)
+    if (row->size - j >= 32) {
+      __m256i v = _mm256_loadu_si256((__m256i *)&row->chars[j]);
+      if (_mm256_movemask_epi8(v)) {
+        editorUpdateRowUtf8(row);
+        return;
+      }
+      unsigned tabs = _mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+      // c - '0' <= 9 as unsigned bytes, i.e. min(c - '0', 9) == c - '0'
+      __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+      __m256i digits =
+          _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+      _mm256_storeu_si256((__m256i *)&render[idx], v);
+      _mm256_storeu_si256(
+          (__m256i *)&hl[idx],
+          _mm256_and_si256(digits, _mm256_set1_epi8(HL_NUMBER)));
+      // Only keep what came before the first tab
+      int n = tabs ? __builtin_ctz(tabs) : 32;
+      idx += n;
+      j += n;
+      if (n == 32)
+        continue;
+      stop = j + 1;
+    }
+#elif defined(__SSE2__)
+    if (row->size - j >= 16) {
+      __m128i v = _mm_loadu_si128((__m128i *)&row->chars[j]);
+      if (_mm_movemask_epi8(v)) {
+        editorUpdateRowUtf8(row);
+        return;
+      }
+      unsigned tabs =
+          _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+      // c - '0' <= 9 as unsigned bytes, i.e. min(c - '0', 9) == c - '0'
+      __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+      __m128i digits = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+      _mm_storeu_si128((__m128i *)&render[idx], v);
+      _mm_storeu_si128((__m128i *)&hl[idx],
+                       _mm_and_si128(digits, _mm_set1_epi8(HL_NUMBER)));
+      // Only keep what came before the first tab
+      int n = tabs ? __builtin_ctz(tabs) : 16;
+      idx += n;
+      j += n;
+      if (n == 16)
+        continue;
+      stop = j + 1;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    if (row->size - j >= 16) {
+      uint8x16_t v = vld1q_u8((uint8_t *)&row->chars[j]);
+      // NEON has no movemask, so blocks with a tab (or UTF-8) are left to
+      // the scalar loop as a whole
+      if (vmaxvq_u8(vceqq_u8(v, vdupq_n_u8('\t'))) == 0 &&
+          vmaxvq_u8(v) < 0x80) {
+        uint8x16_t digits = vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')),
+                                     vdupq_n_u8(9));
+        vst1q_u8((uint8_t *)&render[idx], v);
+        vst1q_u8(&hl[idx], vandq_u8(digits, vdupq_n_u8(HL_NUMBER)));
+        idx += 16;
+        j += 16;
+        continue;
+      }
+      stop = j + 16;
+    }
+#endif
+
+    while (j < stop) {
+      char c = row->chars[j++];
+      if (c & 0x80) {
+        editorUpdateRowUtf8(row);
+        return;
+      }
+      if (c == '\t') {
+        if (idx + KILO_TAB_STOP + (row->size - j) + RENDER_SLACK + 1 > cap) {
+          editorRowReserveRender(row, idx + KILO_TAB_STOP + (row->size - j),
+                                 idx);
+          cap = row->rcap;
+          render = row->render;
+          hl = row->hl;
+        }
+        do {
+          render[idx] = ' ';
+          hl[idx++] = HL_NORMAL;
+        } while (idx % KILO_TAB_STOP != 0);
+        if (row->ntabs == row->tabcap)
+          editorRowReserveTabs(row, row->ntabs + 1);
+        row->tabs[row->ntabs].cx = j - 1;
+        row->tabs[row->ntabs++].rx = idx;
+      } else {
+        render[idx] = c;
+        hl[idx++] = IS_DIGIT(c) ? HL_NUMBER : HL_NORMAL;
+      }
+    }
+  }
+  render[idx] = '\0';
+  row->rsize = idx;
+  row->utf8 = 0;
+  row->hl_drawn = HLS_STALE;
+}
+
+// Renders a row with UTF-8 in it, a char at a time. `render` keeps the UTF-8
+// with each byte that isn't valid swapped for a '?', so that it's safe to
+// send to the terminal and still lines up with `chars` char for char. These
+// rows don't keep a tab index, positions in them get walked to instead.
+void editorUpdateRowUtf8(erow *row) {
+  int ntabs = 0;
+  for (int j = 0; j < row->size; j++)
+    ntabs += row->chars[j] == '\t';
+  editorRowReserveRender(row, row->size + ntabs * (KILO_TAB_STOP - 1), 0);
+  char *render = row->render;
+  unsigned char *hl = row->hl;
+
+  int idx = 0, col = 0;
+  for (int j = 0; j < row->size;) {
+    if (row->chars[j] == '\t') {
+      do {
+        render[idx] = ' ';
+        hl[idx++] = HL_NORMAL;
+      } while (++col % KILO_TAB_STOP != 0);
+      j++;
+      continue;
+    }
+    int width, end = j + utf8Grapheme(&row->chars[j], row->size - j, &width);
+    while (j < end) {
+      int cp, len = utf8Decode(&row->chars[j], end - j, &cp);
+      if (len == 0) {
+        render[idx] = '?';
+        hl[idx++] = HL_NORMAL;
+        j++;
+        continue;
+      }
+      memcpy(&render[idx], &row->chars[j], len);
+      memset(&hl[idx], IS_DIGIT(cp) ? HL_NUMBER : HL_NORMAL, len);
+      idx += len;
+      j += len;
+    }
+    col += width;
+  }
+  render[idx] = '\0';
+  row->rsize = idx;
+  row->ntabs = 0;
+  row->utf8 = 1;
+  row->hl_drawn = HLS_STALE;
+}
+
+// Renders chars[from, to) at column `rx` onwards, returns the column after
+int editorRenderSpan(erow *row, int from, int to, int rx) {
+  for (int j = from; j < to; j++) {
+    char c = row->chars[j];
+    if (c == '\t') {
+      do {
+        row->render[rx] = ' ';
+        row->hl[rx++] = HL_NORMAL;
+      } while (rx % KILO_TAB_STOP != 0);
+    } else {
+      row->render[rx] = c;
+      row->hl[rx++] = IS_DIGIT(c) ? HL_NUMBER : HL_NORMAL;
+    }
+  }
+  return rx;
+}
+
+// Patches `render`, `hl` and the tab index after chars[at, at + inserted)
+// replaced `deleted` chars that used to be rendered in columns [rx, oldend).
+// Past the edit every char renders the same as before, only shifted, until
+// some tab absorbs the shift and alignment resyncs. So we only re-render up
+// to that tab and slide the rest of the row over in place.
+void editorUpdateRowSpan(erow *row, int at, int deleted, int inserted, int rx,
+                         int oldend) {
+  row->hl_start = row->hl_drawn = HLS_STALE;
+  // Rows that were never rendered can stay that way
+  if (row->render == NULL)
+    return;
+  // Columns don't follow bytes once there's UTF-8 on either side of the edit,
+  // so those rows get rendered again whole
+  if (row->utf8 || !utf8IsAscii(&row->chars[at], inserted)) {
+    editorUpdateRow(row);
+    return;
+  }
+
+  // Swap the tabs that were in the deleted chars for the inserted ones
+  int k = editorRowTabAfter(row, at);
+  int end = editorRowTabAfter(row, at + deleted);
+  int added = 0;
+  for (int j = at; j < at + inserted; j++)
+    if (row->chars[j] == '\t')
+      added++;
+  if (added || end > k) {
+    editorRowReserveTabs(row, row->ntabs - (end - k) + added);
+    memmove(&row->tabs[k + added], &row->tabs[end],
+            sizeof(tabstop) * (row->ntabs - end));
+    row->ntabs += added - (end - k);
+  }
+
+  // Work out the new column where the inserted text ends
+  int newcol = rx;
+  int t = k;
+  for (int j = at; j < at + inserted; j++) {
+    if (row->chars[j] == '\t') {
+      newcol += KILO_TAB_STOP - newcol % KILO_TAB_STOP;
+      row->tabs[t].cx = j;
+      row->tabs[t++].rx = newcol;
+    } else {
+      newcol++;
+    }
+  }
+
+  // Then step from tab to tab until the old and new columns meet, or there
+  // are no more tabs to line them back up. The tabs all move over in `chars`
+  // either way.
+  int oldcol = oldend;
+  int j = at + inserted;
+  for (; t < row->ntabs; t++) {
+    row->tabs[t].cx += inserted - deleted;
+    if (newcol == oldcol)
+      continue;
+    int plain = row->tabs[t].cx - j;
+    newcol += plain + KILO_TAB_STOP - (newcol + plain) % KILO_TAB_STOP;
+    oldcol = row->tabs[t].rx;
+    row->tabs[t].rx = newcol;
+    j += plain + 1;
+  }
+
+  int rsize = row->rsize + newcol - oldcol;
+  editorRowReserveRender(row, rsize, row->rsize + 1);
+  // Shift the unchanged tail first (along with the NUL), then fill in the
+  // span in front of it
+  memmove(&row->render[newcol], &row->render[oldcol], row->rsize - oldcol + 1);
+  memmove(&row->hl[newcol], &row->hl[oldcol], row->rsize - oldcol);
+  editorRenderSpan(row, at, j, rx);
+  row->rsize = rsize;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows)
+    return;
+
+  erow row;
+  row.size = len;
+  row.chars = arenaAlloc(&E.arena, len + 1, &row.ccap);
+  row.gen = savejob.gen;
+  memcpy(row.chars, s, len);
+  row.chars[len] = '\0';
+
+  row.rsize = 0;
+  row.render = NULL;
+  row.hl = NULL;
+  row.rcap = 0;
+  row.tabs = NULL;
+  row.ntabs = row.tabcap = 0;
+  row.hl_start = row.hl_drawn = HLS_STALE;
+  row.hl_state = HLS_NORMAL;
+  row.utf8 = 0;
+  row.height = 1;
+  row.wrapgen = 0;
+
+  editorSyntaxInvalidate(at);
+  rowtreeInsertRow(at, &row);
+  E.numrows++;
+  editorUpdateRow(editorRowAt(at));
+  editorWrapUpdate(at);
+
+  // This gives us an idea of how dirty the file is since we aren't using
+  // a boolean
+  E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+  arenaFree(&E.arena, row->render, row->rcap * 2);
+  arenaFree(&E.arena, row->tabs, sizeof(tabstop) * row->tabcap);
+  editorRowFreeChars(row);
+}
+
+// Rows that still point into the mapped file, or that a save is in the middle
+// of writing, have to be copied into memory of their own before they can be
+// modified.
+void editorRowMakeWritable(erow *row) {
+  if (row->ccap && !editorRowFrozen(row))
+    return;
+  int cap;
+  char *chars = arenaAlloc(&E.arena, row->size + 1, &cap);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  editorRowFreeChars(row);
+  row->chars = chars;
+  row->ccap = cap;
+  row->gen = savejob.gen;
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows)
+    return;
+  erow row;
+  editorSyntaxInvalidate(at);
+  rowtreeDeleteRow(at, &row);
+  editorFreeRow(&row);
+  E.numrows--;
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, char *s, size_t len) {
+  // Allowing going one index more than the row size to allow appending to
+  // a row
+  if (at < 0 || at > row->size)
+    at = row->size;
+
+  editorRowMakeWritable(row);
+  int rx = row->render ? editorRowCxToRx(row, at) : 0;
+  editorRowReserveChars(row, row->size + len);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  // Update `render` and `rsize` fields
+  editorUpdateRowSpan(row, at, 0, len, rx, rx);
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  char ch = c;
+  editorRowInsertString(row, at, &ch, 1);
+}
+
+// Cuts the row short at `at`
+void editorRowTruncate(erow *row, int at) {
+  editorRowMakeWritable(row);
+  int rx = row->render ? editorRowCxToRx(row, at) : 0;
+  int deleted = row->size - at;
+  row->size = at;
+  row->chars[row->size] = '\0';
+  editorUpdateRowSpan(row, at, deleted, 0, rx, row->rsize);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowMakeWritable(row);
+  editorRowReserveChars(row, row->size + len);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRowSpan(row, row->size - len, 0, len, row->rsize, row->rsize);
+  E.dirty++;
+}
+
+// Basically do the opposite of editorRowInsertString
+void editorRowDelChars(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size)
+    return;
+  editorRowMakeWritable(row);
+  int rx = 0, oldend = 0;
+  if (row->render) {
+    rx = editorRowCxToRx(row, at);
+    oldend = editorRowCxToRx(row, at + len);
+  }
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorUpdateRowSpan(row, at, len, 0, rx, oldend);
+  E.dirty++;
+}
+
+/* Editor operations */
+
+// If the user is at the end of the file, we append a newline before
+// inserting anything
+void editorEnsureRow() {
+  if (E.cy == E.numrows) {
+    editorUndoRecord(UNDO_NEWROW, E.numrows, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+}
+
+void editorInsertString(char *s, int len) {
+  editorEnsureRow();
+  editorUndoRecord(UNDO_INSERT, E.cy, E.cx, s, len);
+  editorSyntaxInvalidate(E.cy);
+  editorRowInsertString(editorRowAt(E.cy), E.cx, s, len);
+  editorWrapUpdate(E.cy);
+  E.cx += len;
+}
+
+void editorInsertChar(int c) {
+  char ch = c;
+  editorInsertString(&ch, 1);
+}
+
+// Inserts text that may span several lines at the cursor, e.g. a paste.
+// Rather than splitting the row again for each line, whatever was after the
+// cursor is put aside and joined back onto the last line.
+void editorInsertText(char *s, int len) {
+  int end = 0;
+  while (end < len && s[end] != '\r' && s[end] != '\n')
+    end++;
+  if (end == len) {
+    editorInsertString(s, len);
+    return;
+  }
+
+  editorEnsureRow();
+  editorUndoRecord(UNDO_INSERT, E.cy, E.cx, s, len);
+  editorSyntaxInvalidate(E.cy);
+  erow *row = editorRowAt(E.cy);
+  int taillen = row->size - E.cx;
+  char *tail = malloc(taillen + 1);
+  if (tail == NULL)
+    die("malloc");
+  memcpy(tail, &row->chars[E.cx], taillen);
+  editorRowTruncate(row, E.cx);
+  editorRowAppendString(row, s, end);
+  editorWrapUpdate(E.cy);
+
+  while (end < len) {
+    // Take \r\n as a single newline
+    int start = end + 1;
+    if (s[end] == '\r' && start < len && s[start] == '\n')
+      start++;
+    end = start;
+    while (end < len && s[end] != '\r' && s[end] != '\n')
+      end++;
+
+    E.cy++;
+    if (end < len) {
+      editorInsertRow(E.cy, &s[start], end - start);
+    } else {
+      E.cx = end - start;
+      char *last = malloc(E.cx + taillen + 1);
+      if (last == NULL)
+        die("malloc");
+      memcpy(last, &s[start], E.cx);
+      memcpy(&last[E.cx], tail, taillen);
+      editorInsertRow(E.cy, last, E.cx + taillen);
+      free(last);
+    }
+  }
+  free(tail);
+}
+
+void editorInsertNewline() {
+  if (E.cy == E.numrows) {
+    editorEnsureRow();
+  } else if (E.cx == 0) {
+    editorUndoRecord(UNDO_INSERT, E.cy, 0, "\n", 1);
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx, "\n", 1);
+    editorSyntaxInvalidate(E.cy);
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    // Fetch again as editorInsertRow may move rows around in their leaf
+    editorRowTruncate(editorRowAt(E.cy), E.cx);
+    editorWrapUpdate(E.cy);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar() {
+  // Nothing to delete past the end of the file
+  if (E.cy == E.numrows)
+    return;
+  // Check if we are at the beginning of the first line
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  // See if there is a character to the left of the cursor and delete it
+  erow *row = editorRowAt(E.cy);
+  editorSyntaxInvalidate(E.cy - 1);
+  if (E.cx > 0) {
+    int at = editorRowPrevChar(row, E.cx);
+    editorUndoRecord(UNDO_DELETE, E.cy, at, &row->chars[at], E.cx - at);
+    editorRowDelChars(row, at, E.cx - at);
+    editorWrapUpdate(E.cy);
+    E.cx = at;
+  } else {
+    // We are at the start of some line
+    erow *prev = editorRowAt(E.cy - 1);
+    editorUndoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+    editorWrapUpdate(E.cy);
+  }
+}
+
+// Deletes the text `s` starting at (`col`, `at`), which has to be what's there
+void editorDeleteText(int at, int col, char *s, int len) {
+  int endrow = at, endcol = col;
+  for (int j = 0; j < len; j++) {
+    if (s[j] == '\n') {
+      endrow++;
+      endcol = 0;
+    } else {
+      endcol++;
+    }
+  }
+
+  editorSyntaxInvalidate(at);
+  erow *first = editorRowAt(at);
+  if (endrow == at) {
+    editorRowDelChars(first, col, len);
+    editorWrapUpdate(at);
+    return;
+  }
+  // What's left of the last row goes onto the first, then the rows in
+  // between go. The last row may be the one past the end of the file.
+  erow *last = editorRowAt(endrow);
+  editorRowTruncate(first, col);
+  if (last)
+    editorRowAppendString(first, &last->chars[endcol], last->size - endcol);
+  else
+    endrow--;
+  for (int j = endrow; j > at; j--)
+    editorDelRow(j);
+  editorWrapUpdate(at);
+}
+
+// Deletes up to `n` chars from the cursor on, a newline counting as one
+void editorDelForward(int n) {
+  if (E.cy == E.numrows || n <= 0)
+    return;
+  char *text = malloc(n);
+  if (text == NULL)
+    die("malloc");
+  int len = 0;
+  rowiter it;
+  editorRowIterInit(&it, E.cy);
+  erow *row = editorRowIterNext(&it);
+  int col = E.cx;
+  while (row && len < n) {
+    int take = row->size - col < n - len ? row->size - col : n - len;
+    memcpy(&text[len], &row->chars[col], take);
+    len += take;
+    col = 0;
+    row = editorRowIterNext(&it);
+    if (row && len < n)
+      text[len++] = '\n';
+  }
+  if (len) {
+    editorUndoRecord(UNDO_DELETE, E.cy, E.cx, text, len);
+    editorDeleteText(E.cy, E.cx, text, len);
+  }
+  free(text);
+}
+
+/* Undo */
+
+// Grows the text buffer to take `len` more bytes
+char *editorUndoReserve(size_t len) {
+  if (undo.textlen + len > undo.textcap) {
+    size_t cap = undo.textcap ? undo.textcap : 4096;
+    while (cap < undo.textlen + len)
+      cap *= 2;
+    char *text = realloc(undo.text, cap);
+    if (text == NULL)
+      die("realloc");
+    undo.text = text;
+    undo.textcap = cap;
+  }
+  return &undo.text[undo.textlen];
+}
+
+// Forgets the oldest half of the text once there's too much of it, a whole
+// group at a time. The group the last edit went into is always kept, even if
+// it alone is over the limit, so that it can still be undone.
+void editorUndoTrim() {
+  if (undo.textlen <= UNDO_MAX_TEXT)
+    return;
+  int keep = undo.nrecs - 1;
+  while (keep > 0 && undo.recs[keep - 1].group == undo.recs[keep].group)
+    keep--;
+  int n = 0;
+  while (n < keep && undo.recs[n].off < undo.textlen / 2)
+    n++;
+  while (n > 0 && n < keep && undo.recs[n].group == undo.recs[n - 1].group)
+    n++;
+  if (n == 0)
+    return;
+  size_t cut = undo.recs[n].off;
+  memmove(undo.text, &undo.text[cut], undo.textlen - cut);
+  undo.textlen -= cut;
+  memmove(undo.recs, &undo.recs[n], sizeof(undorec) * (undo.nrecs - n));
+  undo.nrecs -= n;
+  undo.pos -= n;
+  for (int j = 0; j < undo.nrecs; j++)
+    undo.recs[j].off -= cut;
+}
+
+// Logs an edit just before it's made. Pasted \r and \r\n newlines are logged
+// as \n, the way they end up in the rows.
+void editorUndoRecord(int type, int row, int col, char *s, int len) {
+  if (undo.replaying)
+    return;
+
+  // Whatever was undone can't be redone after this
+  undo.nrecs = undo.pos;
+  undorec *last = undo.nrecs ? &undo.recs[undo.nrecs - 1] : NULL;
+  undo.textlen = last ? last->off + last->len : 0;
+
+  // Room for a second copy, see the backspacing case below
+  int endrow = row, endcol = col, n = 0;
+  char *text = editorUndoReserve(len * 2);
+  for (int j = 0; j < len; j++) {
+    if (s[j] == '\r' && j + 1 < len && s[j + 1] == '\n')
+      continue;
+    text[n++] = s[j] == '\r' ? '\n' : s[j];
+    if (text[n - 1] == '\n') {
+      endrow++;
+      endcol = 0;
+    } else {
+      endcol++;
+    }
+  }
+  journalRecord(type, row, col, text, n);
+
+  if (undo.open && last && last->type == type && type != UNDO_NEWROW) {
+    if (type == UNDO_INSERT && row == undo.endrow && col == undo.endcol) {
+      // Typing on after the last insert
+      undo.textlen += n;
+      last->len += n;
+      undo.endrow = endrow;
+      undo.endcol = endcol;
+      return;
+    }
+    if (type == UNDO_DELETE && row == last->row && col == last->col) {
+      // Deleting forwards
+      undo.textlen += n;
+      last->len += n;
+      return;
+    }
+    if (type == UNDO_DELETE && endrow == last->row && endcol == last->col) {
+      // Backspacing, what was deleted now goes in front
+      memcpy(&text[n], text, n);
+      memmove(&text[n - last->len], &text[-last->len], last->len);
+      memcpy(&text[-last->len], &text[n], n);
+      undo.textlen += n;
+      last->len += n;
+      last->row = row;
+      last->col = col;
+      return;
+    }
+  }
+
+  if (undo.nrecs == undo.reccap) {
+    undo.reccap = undo.reccap ? undo.reccap * 2 : 64;
+    undo.recs = realloc(undo.recs, sizeof(undorec) * undo.reccap);
+    if (undo.recs == NULL)
+      die("realloc");
+  }
+  undorec *rec = &undo.recs[undo.nrecs++];
+  rec->type = type;
+  rec->group = undo.group;
+  rec->row = row;
+  rec->col = col;
+  rec->off = undo.textlen;
+  rec->len = n;
+  undo.textlen += n;
+  undo.pos = undo.nrecs;
+  undo.open = 1;
+  undo.endrow = endrow;
+  undo.endcol = endcol;
+  editorUndoTrim();
+}
+
+// Stops the next edit from being added on to the last one
+void editorUndoBreak() { undo.open = 0; }
+
+void editorUndoReset() {
+  undo.nrecs = undo.pos = 0;
+  undo.textlen = 0;
+  undo.open = 0;
+}
+
+// Makes the edit a record stands for, or rolls it back if `reverse` is set,
+// and leaves the cursor where it happened
+void editorUndoApply(undorec *rec, int reverse) {
+  char *s = &undo.text[rec->off];
+  int insert = (rec->type == UNDO_INSERT) != reverse;
+  // Undoing and redoing changes the file as much as anything else
+  if (rec->type == UNDO_NEWROW)
+    journalRecord(reverse ? UNDO_DELROW : UNDO_NEWROW, rec->row, 0, NULL, 0);
+  else
+    journalRecord(insert ? UNDO_INSERT : UNDO_DELETE, rec->row, rec->col, s,
+                  rec->len);
+  undo.replaying = 1;
+  E.cy = rec->row;
+  E.cx = rec->col;
+  if (rec->type == UNDO_NEWROW) {
+    if (reverse)
+      editorDelRow(rec->row);
+    else
+      editorInsertRow(rec->row, "", 0);
+  } else if (insert) {
+    editorInsertText(s, rec->len);
+  } else {
+    editorDeleteText(rec->row, rec->col, s, rec->len);
+  }
+  undo.replaying = 0;
+}
+
+void editorUndo() {
+  editorUndoBreak();
+  if (undo.pos == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  unsigned group = undo.recs[undo.pos - 1].group;
+  while (undo.pos > 0 && undo.recs[undo.pos - 1].group == group)
+    editorUndoApply(&undo.recs[--undo.pos], 1);
+}
+
+void editorRedo() {
+  editorUndoBreak();
+  if (undo.pos == undo.nrecs) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  unsigned group = undo.recs[undo.pos].group;
+  while (undo.pos < undo.nrecs && undo.recs[undo.pos].group == group)
+    editorUndoApply(&undo.recs[undo.pos++], 0);
+}
+
+/* Journal */
+
+// Edits waiting in memory are written out before every refresh, and the
+// swap file synced at most this often while there are edits since
+#define JOURNAL_SYNC_MS 1000
+
+// Every edit made since the file was last saved gets appended to a swap file
+// next to it, ".name.swp", so a crash costs no more than the last second of
+// work. It starts with a header saying which version of the file the edits
+// were made to, and is replayed on top of it when the file is opened again,
+// see journalRecover. Writing it costs as much as the edit, however big the
+// file.
+#define JOURNAL_MAGIC "kiloswp1"
+
+typedef struct journalhead {
+  char magic[8];
+  long long size, mtime, mtimens;
+} journalhead;
+
+// Followed by `len` bytes of text for UNDO_INSERT and UNDO_DELETE
+typedef struct journalrec {
+  int type, row, col, len;
+} journalrec;
+
+struct editorJournal {
+  // -1 when there's no swap file open. It's created on the first edit.
+  int fd;
+  char *path;
+  // Set when there shouldn't be one, e.g. a swap file we couldn't recover
+  // from is in the way
+  int off;
+  // How much of it there is on disk, and how much of that the save under
+  // way will have made redundant
+  long long size, saved;
+  // Not written out yet
+  char *buf;
+  size_t len, cap;
+  // Whether there is written data to sync, and by when
+  int unsynced;
+  long long syncdue;
+};
+
+struct editorJournal journal = {.fd = -1};
+
+char *journalPath(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 6);
+  if (path == NULL)
+    die("malloc");
+  sprintf(path, "%.*s.%s.swp", dirlen, filename, &filename[dirlen]);
+  return path;
+}
+
+// Fills in the header for the file as it is on disk now
+int journalHead(journalhead *head) {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1)
+    return -1;
+  memset(head, 0, sizeof(*head));
+  memcpy(head->magic, JOURNAL_MAGIC, sizeof(head->magic));
+  head->size = st.st_size;
+  head->mtime = st.st_mtim.tv_sec;
+  head->mtimens = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+// Writes all of `len` bytes at `off`
+int journalWrite(int fd, char *p, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t w = pwrite(fd, p, len, off);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    len -= w;
+    off += w;
+  }
+  return 0;
+}
+
+// Closes the swap file, and removes it unless `keep` is set, e.g. once
+// everything in it has been saved
+void journalClose(struct editorJournal *j, int keep) {
+  if (j->fd != -1) {
+    close(j->fd);
+    if (!keep)
+      unlink(j->path);
+  }
+  free(j->path);
+  free(j->buf);
+  *j = (struct editorJournal){.fd = -1};
+}
+
+void journalFail() {
+  editorSetStatusMessage("Can't write swap file: %s", strerror(errno));
+  journalClose(&journal, 0);
+  journal.off = 1;
+}
+
+void journalStart() {
+  journalhead head;
+  if (journalHead(&head) == -1)
+    return;
+  journal.path = journalPath(E.filename);
+  journal.fd = open(journal.path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (journal.fd == -1 ||
+      journalWrite(journal.fd, (char *)&head, sizeof(head), 0) == -1) {
+    journalFail();
+    return;
+  }
+  journal.size = sizeof(head);
+  // The header is for the file as it was before the save under way, if
+  // there is one, and gets updated once that's done
+  journal.saved = savejob.running ? journal.size : -1;
+}
+
+// Logs an edit (see editorUndoRecord) to go out with the next journalFlush
+void journalRecord(int type, int row, int col, char *s, int len) {
+  if (journal.off || E.batch || E.filename == NULL)
+    return;
+  if (journal.fd == -1) {
+    journalStart();
+    if (journal.fd == -1)
+      return;
+  }
+  journalrec rec = {type, row, col, len};
+  size_t need = journal.len + sizeof(rec) + len;
+  if (need > journal.cap) {
+    journal.cap = journal.cap ? journal.cap : 4096;
+    while (journal.cap < need)
+      journal.cap *= 2;
+    journal.buf = realloc(journal.buf, journal.cap);
+    if (journal.buf == NULL)
+      die("realloc");
+  }
+  memcpy(&journal.buf[journal.len], &rec, sizeof(rec));
+  if (len)
+    memcpy(&journal.buf[journal.len + sizeof(rec)], s, len);
+  journal.len = need;
+}
+
+// Syncs what's been written so far, unless told not to
+void journalSync() {
+  if (journal.unsynced && editorDurability() != DURABILITY_NONE)
+    fdatasync(journal.fd);
+  journal.unsynced = 0;
+}
+
+// Writes out what's been logged since last time, and syncs if it's been long
+// enough since the first write that hasn't been
+void journalFlush() {
+  if (journal.fd == -1)
+    return;
+  if (journal.len) {
+    if (journalWrite(journal.fd, journal.buf, journal.len, journal.size) ==
+        -1) {
+      journalFail();
+      return;
+    }
+    journal.size += journal.len;
+    journal.len = 0;
+    if (!journal.unsynced) {
+      journal.unsynced = 1;
+      journal.syncdue = editorNowMs() + JOURNAL_SYNC_MS;
+    }
+  }
+  if (journal.unsynced && editorNowMs() >= journal.syncdue)
+    journalSync();
+}
+
+// A save is taking its snapshot, what's in the swap file so far will be in
+// the file once that's written
+void journalSaveStart() {
+  journalFlush();
+  journal.saved = journal.fd == -1 ? -1 : journal.size;
+}
+
+// The save went through, so only edits made while it was under way need to
+// be kept, now on top of the file as saved. They go in a new swap file that
+// is renamed over the old one, so a crash part way leaves one or the other
+// and never a header for the new file in front of edits already in it.
+void journalSaved() {
+  journalFlush();
+  if (journal.fd == -1 || journal.saved == -1)
+    return;
+  long long keep = journal.size - journal.saved;
+  journalhead head;
+  if (keep == 0 || journalHead(&head) == -1) {
+    journalClose(&journal, 0);
+    return;
+  }
+  char *tail = malloc(keep);
+  char *tmp = malloc(strlen(journal.path) + 8);
+  if (tail == NULL || tmp == NULL)
+    die("malloc");
+  sprintf(tmp, "%s.XXXXXX", journal.path);
+  int durability = editorDurability();
+  int fd = mkstemp(tmp);
+  int ok = fd != -1 && pread(journal.fd, tail, keep, journal.saved) == keep &&
+           journalWrite(fd, (char *)&head, sizeof(head), 0) != -1 &&
+           journalWrite(fd, tail, keep, sizeof(head)) != -1 &&
+           (durability == DURABILITY_NONE || fdatasync(fd) != -1) &&
+           rename(tmp, journal.path) != -1;
+  free(tail);
+  if (!ok) {
+    int err = errno;
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    errno = err;
+    journalFail();
+    return;
+  }
+  free(tmp);
+  if (durability == DURABILITY_FULL)
+    editorSyncDir(journal.path);
+  close(journal.fd);
+  journal.fd = fd;
+  journal.size = sizeof(head) + keep;
+  journal.saved = -1;
+  journal.unsynced = 0;
+}
+
+// Whether `s` is what the rows hold from (`col`, `at`) on, newlines and all.
+// The last newline may be the one at the end of the last row.
+int journalMatches(int at, int col, char *s, int len) {
+  while (len > 0) {
+    erow *row = editorRowAt(at);
+    if (row == NULL || col > row->size)
+      return 0;
+    char *nl = memchr(s, '\n', len);
+    int n = nl ? nl - s : len;
+    if (n > row->size - col || memcmp(&row->chars[col], s, n) != 0)
+      return 0;
+    if (nl == NULL)
+      break;
+    if (col + n != row->size)
+      return 0;
+    s += n + 1;
+    len -= n + 1;
+    at++;
+    col = 0;
+  }
+  return 1;
+}
+
+// Makes an edit from the swap file, if it fits the rows as they are. Text
+// to delete has to be what's there, or the edits were made to some other
+// version of the rows.
+int journalApply(journalrec *rec, char *s) {
+  erow *row = editorRowAt(rec->row);
+  switch (rec->type) {
+  case UNDO_NEWROW:
+    if (rec->row != E.numrows)
+      return -1;
+    break;
+  case UNDO_DELROW:
+    if (row == NULL || row->size)
+      return -1;
+    break;
+  case UNDO_INSERT:
+  case UNDO_DELETE:
+    if (row == NULL || rec->col < 0 || rec->col > row->size)
+      return -1;
+    if (rec->type == UNDO_DELETE &&
+        !journalMatches(rec->row, rec->col, s, rec->len))
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  E.cy = rec->row;
+  E.cx = rec->col;
+  if (rec->type == UNDO_NEWROW)
+    editorInsertRow(rec->row, "", 0);
+  else if (rec->type == UNDO_DELROW)
+    editorDelRow(rec->row);
+  else if (rec->type == UNDO_INSERT)
+    editorInsertText(s, rec->len);
+  else
+    editorDeleteText(rec->row, rec->col, s, rec->len);
+  return 0;
+}
+
+// Replays the swap file left behind for the file just opened, if there is
+// one, and carries on appending to it. It's left alone if it was made for
+// some other version of the file.
+void journalRecover() {
+  if (E.batch || E.readonly || E.filename == NULL)
+    return;
+  char *path = journalPath(E.filename);
+  int fd = open(path, O_RDWR);
+  struct stat st;
+  journalhead head, now;
+  if (fd == -1 || fstat(fd, &st) == -1 ||
+      st.st_size < (off_t)sizeof(head) ||
+      read(fd, &head, sizeof(head)) != sizeof(head) ||
+      memcmp(head.magic, JOURNAL_MAGIC, sizeof(head.magic)) != 0) {
+    if (fd != -1)
+      close(fd);
+    free(path);
+    return;
+  }
+  if (journalHead(&now) == -1 || now.size != head.size ||
+      now.mtime != head.mtime || now.mtimens != head.mtimens) {
+    editorSetStatusMessage("%s doesn't match the file, not recovered", path);
+    close(fd);
+    free(path);
+    journal.off = 1;
+    return;
+  }
+
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    die("mmap");
+  // A record cut short by the crash, or one that doesn't fit, ends it
+  long long at = sizeof(head);
+  int edits = 0;
+  // Recovered edits can't be undone, and are in the swap file already
+  undo.replaying = 1;
+  while (at + (long long)sizeof(journalrec) <= st.st_size) {
+    journalrec rec;
+    memcpy(&rec, &data[at], sizeof(rec));
+    if (rec.len < 0 || rec.len > st.st_size - at - (long long)sizeof(rec) ||
+        journalApply(&rec, &data[at + sizeof(rec)]) == -1)
+      break;
+    at += sizeof(rec) + rec.len;
+    edits++;
+  }
+  undo.replaying = 0;
+  munmap(data, st.st_size);
+
+  if (ftruncate(fd, at) == -1) {
+    close(fd);
+    free(path);
+    journal.off = 1;
+    return;
+  }
+  journal.fd = fd;
+  journal.path = path;
+  journal.size = at;
+  journal.saved = -1;
+  E.dirty = edits;
+  if (edits)
+    editorSetStatusMessage("Recovered %d edits from %s", edits, path);
+}
+
+/* File i/o */
+
+// Writes all of `iov`, picking up where writev left off if it stops short
+int editorWritev(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+void editorSnapshotAdd(struct editorSaveJob *job, char *p, size_t len) {
+  struct iovec *last = job->niov ? &job->iov[job->niov - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == p) {
+    last->iov_len += len;
+    return;
+  }
+  if (len == 0)
+    return;
+  if (job->niov == job->iovcap) {
+    job->iovcap = job->iovcap ? job->iovcap * 2 : 1024;
+    job->iov = realloc(job->iov, sizeof(struct iovec) * job->iovcap);
+    if (job->iov == NULL)
+      die("realloc");
+  }
+  job->iov[job->niov].iov_base = p;
+  job->iov[job->niov++].iov_len = len;
+}
+
+// Lists where every row's chars and the newline after it can be found, for
+// editorWriteFile to write out straight from the rows' own memory. Rows still
+// in the mapping are followed by their newline there, so runs of untouched
+// lines collapse into a single iovec.
+void editorSnapshotRows(struct editorSaveJob *job) {
+  static char newline = '\n';
+  rowiter it;
+  char *p;
+  int size;
+  job->niov = 0;
+  job->total = 0;
+  editorRowIterInit(&it, 0);
+  while ((p = editorRowIterText(&it, &size)) != NULL) {
+    size_t len = size;
+    if (p >= E.map && p + len < E.map + E.maplen && p[len] == '\n') {
+      editorSnapshotAdd(job, p, len + 1);
+    } else {
+      editorSnapshotAdd(job, p, len);
+      editorSnapshotAdd(job, &newline, 1);
+    }
+    job->total += len + 1;
+  }
+}
+
+// Fallback for files that can't be mapped, e.g. pipes and character devices
+void editorReadFile(FILE *fp) {
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\r' || line[linelen - 1] == '\n'))
+      linelen--;
+    editorInsertRow(E.numrows, line, linelen);
+  }
+  free(line);
+}
+
+// Lines are found by splitting the mapping into chunks of this size and
+// having the worker pool go through them in parallel
+#define LOAD_CHUNK_SIZE (8 << 20)
+
+// The lines starting in some chunk, as a list of leaves
+typedef struct loadchunk {
+  rowleaf *first, *last;
+  int nleaves;
+  int nrows;
+} loadchunk;
+
+// Sets up `row` to point at memory holding the line from `p` up to `eol`,
+// which it doesn't own
+void editorRowFromLine(erow *row, char *p, char *eol) {
+  size_t len = eol - p;
+  while (len > 0 && p[len - 1] == '\r')
+    len--;
+  row->size = len;
+  row->chars = p;
+  row->ccap = 0;
+  row->gen = 0;
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->rcap = 0;
+  row->tabs = NULL;
+  row->ntabs = row->tabcap = 0;
+  row->hl_start = row->hl_drawn = HLS_STALE;
+  row->hl_state = HLS_NORMAL;
+  row->utf8 = 0;
+  row->height = 1;
+  row->wrapgen = 0;
+}
+
+// Adds the line in the mapping from `p` up to `eol` to the chunk's last leaf,
+// or to a new one if that's full or the line ends too far from where the leaf
+// starts for its offsets
+void editorIndexLine(loadchunk *chunk, char *p, char *eol) {
+  rowleaf *last = chunk->last;
+  if (last == NULL || last->h.n == ROWTREE_FANOUT ||
+      (size_t)(eol + 1 - last->base) > UINT32_MAX) {
+    rowleaf *leaf = rowtreeNewLeaf();
+    leaf->base = p;
+    memset(leaf->hl_start, HLS_STALE, sizeof(leaf->hl_start));
+    memset(leaf->hl_state, HLS_NORMAL, sizeof(leaf->hl_state));
+    leaf->prev = chunk->last;
+    if (chunk->last)
+      chunk->last->next = leaf;
+    else
+      chunk->first = leaf;
+    chunk->last = leaf;
+    chunk->nleaves++;
+  }
+
+  last = chunk->last;
+  last->off[++last->h.n] = eol + 1 - last->base;
+  chunk->nrows++;
+}
+
+void editorIndexChunk(void *arg, int task) {
+  loadchunk *chunk = &((loadchunk *)arg)[task];
+  size_t from = (size_t)task * LOAD_CHUNK_SIZE;
+  size_t to = E.maplen - from < LOAD_CHUNK_SIZE ? E.maplen
+                                                : from + LOAD_CHUNK_SIZE;
+  char *p = E.map + from;
+  char *end = E.map + to;
+  char *fileend = E.map + E.maplen;
+
+  // Unless the previous chunk ended with a newline, the line we're in the
+  // middle of belongs to it
+  if (from > 0 && p[-1] != '\n') {
+    p = memchr(p, '\n', end - p);
+    if (p == NULL)
+      return;
+    p++;
+  }
+
+  // The last line starting in this chunk may well end in the next one
+  while (p < end) {
+    char *nl = memchr(p, '\n', fileend - p);
+    char *eol = nl ? nl : fileend;
+    editorIndexLine(chunk, p, eol);
+    p = eol + 1;
+  }
+}
+
+// Finds where every line in the mapping starts. This is the only pass made
+// over the file, the rows themselves are only made for leaves that get looked
+// at, and their `render` and `hl` are left for editorDrawRows to fill in for
+// the rows that actually get displayed.
+//
+// The worker pool goes through the mapping a chunk at a time, filling leaves
+// with the lines in each. All that's left to do in order is to chain the
+// leaves together and put a tree on top of them.
+void editorIndexMap() {
+  int nchunks = (E.maplen + LOAD_CHUNK_SIZE - 1) / LOAD_CHUNK_SIZE;
+  loadchunk *chunks = calloc(nchunks, sizeof(loadchunk));
+  if (chunks == NULL)
+    die("calloc");
+
+  // Not worth waking up the pool for a single chunk
+  if (nchunks == 1) {
+    editorIndexChunk(chunks, 0);
+  } else {
+    struct workbatch batch;
+    poolSubmit(&batch, editorIndexChunk, chunks, nchunks);
+    poolWait(&batch);
+  }
+
+  int nleaves = 0;
+  for (int c = 0; c < nchunks; c++)
+    nleaves += chunks[c].nleaves;
+  rownode **leaves = malloc(sizeof(rownode *) * (nleaves ? nleaves : 1));
+  if (leaves == NULL)
+    die("malloc");
+
+  int n = 0;
+  rowleaf *prev = NULL;
+  for (int c = 0; c < nchunks; c++) {
+    for (rowleaf *leaf = chunks[c].first; leaf; leaf = leaf->next) {
+      leaf->prev = prev;
+      if (prev)
+        prev->next = leaf;
+      leaves[n++] = (rownode *)leaf;
+      prev = leaf;
+      if (leaf == chunks[c].last)
+        break;
+    }
+    E.numrows += chunks[c].nrows;
+  }
+  if (n > 0)
+    rowtreeBuild(leaves, n);
+  free(leaves);
+  free(chunks);
+}
+
+// Throws away every row along with the mapping they may point into, leaving
+// an empty file. Their memory all came from the arena, so it goes back in one
+// go rather than row by row. Nothing may be using the rows any more, see
+// editorCloseFile.
+void editorDropRows() {
+  // When other files have rows in the arena too, ours go back one at a time.
+  // Lines that never became rows have nothing there.
+  if (E.nbuffers > 1) {
+    rowiter it;
+    editorRowIterInit(&it, 0);
+    for (rowleaf *leaf = it.leaf; leaf; leaf = leaf->next)
+      for (int j = 0; leaf->row && j < leaf->h.n; j++)
+        editorFreeRow(&leaf->row[j]);
+  } else {
+    arenaReset(&E.arena);
+  }
+  rowtreeFree(E.rows);
+  E.rows = (rownode *)rowtreeNewLeaf();
+  E.numrows = 0;
+  if (E.map) {
+    munmap(E.map, E.maplen);
+    E.map = NULL;
+    E.maplen = 0;
+  }
+  E.cx = E.cy = E.rx = E.rowoff = E.coloff = E.wrapoff = E.dirty = 0;
+  E.hl_valid = 0;
+  editorUndoReset();
+}
+
+void editorCloseFile() {
+  editorSaveFinish(1);
+  editorFollowStop();
+  editorSyntaxStop();
+  // Unsaved changes stay in the swap file for next time
+  journalFlush();
+  journalClose(&journal, E.dirty);
+  pagerClose();
+  editorDropRows();
+}
+
+void editorOpen(char *filename) {
+  editorCloseFile();
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntax();
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    die("fopen");
+
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size > 0) {
+      E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+      if (E.map == MAP_FAILED)
+        die("mmap");
+      E.maplen = st.st_size;
+      if (E.readonly)
+        pagerOpen();
+      else
+        editorIndexMap();
+    }
+  } else {
+    editorReadFile(fp);
+  }
+  fclose(fp);
+  E.dirty = 0;
+  journalRecover();
+  editorWrapInvalidate();
+}
+
+int editorDurability() {
+  char *mode = getenv("KILO_DURABILITY");
+  if (mode == NULL)
+    return KILO_DURABILITY;
+  if (strcmp(mode, "none") == 0)
+    return DURABILITY_NONE;
+  if (strcmp(mode, "full") == 0)
+    return DURABILITY_FULL;
+  return DURABILITY_FILE;
+}
+
+// Makes a rename within the directory of `path` durable
+void editorSyncDir(const char *path) {
+  char *slash = strrchr(path, '/');
+  char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+// Writes the snapshot out a batch of IOV_MAX iovecs at a time, keeping
+// `written` up to date for the status bar
+int editorWriteSnapshot(struct editorSaveJob *job, int fd) {
+  for (int i = 0; i < job->niov; i += IOV_MAX) {
+    int n = job->niov - i < IOV_MAX ? job->niov - i : IOV_MAX;
+    // Add up first, editorWritev eats into the iovecs as it goes
+    long long len = 0;
+    for (int j = 0; j < n; j++)
+      len += job->iov[i + j].iov_len;
+    if (editorWritev(fd, &job->iov[i], n) == -1)
+      return -1;
+
+    pthread_mutex_lock(&job->lock);
+    int before = job->written * 100 / job->total;
+    job->written += len;
+    int after = job->written * 100 / job->total;
+    pthread_mutex_unlock(&job->lock);
+    if (after != before)
+      editorWakeup();
+  }
+  return 0;
+}
+
+// Writes the snapshot to a temporary file next to the target and then renames
+// it over the target, so that a save that fails part way leaves the original
+// file as it was. The mapping keeps pointing at the original, which lives on
+// unchanged now that nothing writes to it. Returns -1 with errno set on
+// failure.
+int editorWriteFile(struct editorSaveJob *job) {
+  const char *target = job->target;
+  char *tmp = malloc(strlen(target) + 8);
+  if (tmp == NULL)
+    return -1;
+  sprintf(tmp, "%s.XXXXXX", target);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    return -1;
+  }
+
+  // mkstemp creates the file as 0600, give it what the original had
+  struct stat st;
+  mode_t mode;
+  if (stat(target, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+
+  int durability = editorDurability();
+  int ok = fchmod(fd, mode) != -1 && editorWriteSnapshot(job, fd) != -1 &&
+           (durability == DURABILITY_NONE || fsync(fd) != -1);
+  int err = errno;
+  if (close(fd) == -1 && ok) {
+    ok = 0;
+    err = errno;
+  }
+  if (ok && rename(tmp, target) == -1) {
+    ok = 0;
+    err = errno;
+  }
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  if (!ok) {
+    errno = err;
+    return -1;
+  }
+
+  if (durability == DURABILITY_FULL)
+    editorSyncDir(target);
+  return 0;
+}
+
+void *editorSaveThread(void *arg) {
+  struct editorSaveJob *job = arg;
+  int err = editorWriteFile(job) == -1 ? errno : 0;
+  pthread_mutex_lock(&job->lock);
+  job->done = 1;
+  job->err = err;
+  pthread_mutex_unlock(&job->lock);
+  editorWakeup();
+  return NULL;
+}
+
+// Reports on the background save once it is done, or waits for it to be if
+// `wait` is set. Whatever was edited after the snapshot was taken is still
+// unsaved.
+void editorSaveFinish(int wait) {
+  if (!savejob.running)
+    return;
+  pthread_mutex_lock(&savejob.lock);
+  int done = savejob.done;
+  pthread_mutex_unlock(&savejob.lock);
+  if (!done && !wait)
+    return;
+
+  pthread_join(savejob.thread, NULL);
+  savejob.running = 0;
+  free(savejob.target);
+  for (int j = 0; j < savejob.ndeferred; j++)
+    arenaFree(&E.arena, savejob.deferred[j].p, savejob.deferred[j].cap);
+  savejob.ndeferred = 0;
+
+  if (savejob.err) {
+    editorSetStatusMessage("Can't save! I/O error: %s",
+                           strerror(savejob.err));
+    return;
+  }
+  E.dirty -= savejob.dirty;
+  journalSaved();
+  editorSetStatusMessage("%lld bytes written to disk", savejob.total);
+}
+
+// Snapshots the rows and leaves writing them out to a thread of its own, so
+// that editing can carry on while a big file is being saved
+// Replace what a symlink points to rather than the symlink itself
+char *editorSaveTarget(char *filename) {
+  char *target = realpath(filename, NULL);
+  return target ? target : strdup(filename);
+}
+
+void editorSave() {
+  if (savejob.running) {
+    editorSetStatusMessage("Still saving, try again once that's done");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  savejob.target = editorSaveTarget(E.filename);
+  savejob.gen++;
+  editorSnapshotRows(&savejob);
+  journalSaveStart();
+  savejob.dirty = E.dirty;
+  savejob.written = 0;
+  savejob.done = 0;
+  savejob.err = 0;
+  if (pthread_create(&savejob.thread, NULL, editorSaveThread, &savejob) != 0)
+    die("pthread_create");
+  savejob.running = 1;
+}
+
+/* Regex */
+
+// Regexes are compiled into DFAs up front: one run forwards to find the
+// earliest point a match can end and then how far the matches under way by
+// then can go, one for the reversed pattern run back from there to find the
+// leftmost start, and one anchored at that start to find the longest match
+// from there. Nothing ever backtracks, each of them reads the text once.
+//
+// Supported are literals, `.`, [classes] with ranges and ^ negation, the
+// escapes \d \w \s (and \D \W \S), grouping, `|`, `*`, `+` and `?`. A `^` at
+// the very start or a `$` at the very end anchors the match to the start or
+// end of the row.
+
+// The DFA gives up on patterns that would need more states than this
+#define RE_MAX_STATES 4096
+
+enum reNodeType {
+  RE_SET,
+  RE_CAT,
+  RE_ALT,
+  RE_STAR,
+  RE_PLUS,
+  RE_QUEST,
+  RE_EMPTY,
+};
+
+typedef struct renode {
+  int type;
+  int a, b; // Operands, as indices into `nodes`
+  int set;  // For RE_SET, an index into `sets`
+} renode;
+
+// NFA states, only sets and the final match state get DFA states built out
+// of them, splits are followed when taking the closure
+enum reStateType { NS_SET, NS_SPLIT, NS_MATCH };
+
+typedef struct restate {
+  int type;
+  int out, out1;
+  int set;
+} restate;
+
+typedef struct dfa {
+  int nclasses;
+  unsigned char classmap[256];
+  int nstates;
+  int *trans;
+  // Built on request for a DFA that restarts: the same transitions without
+  // mixing the start back in, to carry on the matches under way without
+  // starting new ones
+  int *hold;
+  unsigned char *accept;
+  unsigned char *dead;
+} dfa;
+
+typedef struct regex {
+  dfa fwd, rev, anchored;
+  int bol, eol;
+} regex;
+
+// Everything the compiler works with, thrown away once the DFAs are built
+struct recompiler {
+  const char *p;
+  const char *error;
+  renode *nodes;
+  int nnodes;
+  unsigned char (*sets)[32];
+  int nsets;
+  restate *states;
+  int nstates;
+  // See reClosure
+  int *mark;
+  int gen;
+};
+
+int reAddNode(struct recompiler *rc, int type, int a, int b) {
+  rc->nodes = realloc(rc->nodes, sizeof(renode) * (rc->nnodes + 1));
+  if (rc->nodes == NULL)
+    die("realloc");
+  rc->nodes[rc->nnodes] = (renode){type, a, b, -1};
+  return rc->nnodes++;
+}
+
+int reAddSet(struct recompiler *rc) {
+  rc->sets = realloc(rc->sets, 32 * (rc->nsets + 1));
+  if (rc->sets == NULL)
+    die("realloc");
+  memset(rc->sets[rc->nsets], 0, 32);
+  int node = reAddNode(rc, RE_SET, -1, -1);
+  rc->nodes[node].set = rc->nsets++;
+  return node;
+}
+
+void reSetAdd(unsigned char *set, int c) { set[c >> 3] |= 1 << (c & 7); }
+
+int reSetHas(unsigned char *set, int c) { return set[c >> 3] & (1 << (c & 7)); }
+
+// Adds what \d, \w, \s and their negations match to `set`. Returns 0 if `c`
+// isn't one of those.
+int reAddClassEscape(unsigned char *set, int c) {
+  int lower = tolower(c);
+  if (lower != 'd' && lower != 'w' && lower != 's')
+    return 0;
+  for (int j = 0; j < 256; j++) {
+    int in = lower == 'd'   ? isdigit(j)
+             : lower == 'w' ? isalnum(j) || j == '_'
+                            : isspace(j);
+    if ((in != 0) != (c != lower))
+      reSetAdd(set, j);
+  }
+  return 1;
+}
+
+int reParseAlt(struct recompiler *rc);
+
+int reParseAtom(struct recompiler *rc) {
+  char c = *rc->p++;
+
+  if (c == '(') {
+    int node = reParseAlt(rc);
+    if (*rc->p != ')') {
+      rc->error = "missing )";
+      return node;
+    }
+    rc->p++;
+    return node;
+  }
+
+  int node = reAddSet(rc);
+  unsigned char *set = rc->sets[rc->nodes[node].set];
+
+  if (c == '.') {
+    memset(set, 0xff, 32);
+  } else if (c == '\\' && *rc->p) {
+    c = *rc->p++;
+    if (!reAddClassEscape(set, (unsigned char)c))
+      reSetAdd(set, (unsigned char)c);
+  } else if (c == '[') {
+    int negate = *rc->p == '^';
+    if (negate)
+      rc->p++;
+    // A ] straight after the opening bracket is taken literally
+    int first = 1;
+    while (*rc->p && (*rc->p != ']' || first)) {
+      int lo = (unsigned char)*rc->p++;
+      first = 0;
+      if (lo == '\\' && *rc->p) {
+        lo = (unsigned char)*rc->p++;
+        if (reAddClassEscape(set, lo))
+          continue;
+      }
+      int hi = lo;
+      if (rc->p[0] == '-' && rc->p[1] && rc->p[1] != ']') {
+        hi = (unsigned char)rc->p[1];
+        rc->p += 2;
+      }
+      for (int j = lo; j <= hi; j++)
+        reSetAdd(set, j);
+    }
+    if (*rc->p != ']') {
+      rc->error = "missing ]";
+      return node;
+    }
+    rc->p++;
+    if (negate)
+      for (int j = 0; j < 32; j++)
+        set[j] = ~set[j];
+  } else {
+    reSetAdd(set, (unsigned char)c);
+  }
+  return node;
+}
+
+int reParseRepeat(struct recompiler *rc) {
+  if (*rc->p == '*' || *rc->p == '+' || *rc->p == '?') {
+    rc->error = "nothing to repeat";
+    return reAddNode(rc, RE_EMPTY, -1, -1);
+  }
+  int node = reParseAtom(rc);
+  while (*rc->p == '*' || *rc->p == '+' || *rc->p == '?') {
+    char op = *rc->p++;
+    int type = op == '*' ? RE_STAR : op == '+' ? RE_PLUS : RE_QUEST;
+    node = reAddNode(rc, type, node, -1);
+  }
+  return node;
+}
+
+int reParseCat(struct recompiler *rc) {
+  int node = reAddNode(rc, RE_EMPTY, -1, -1);
+  while (*rc->p && *rc->p != '|' && *rc->p != ')' && !rc->error) {
+    // A trailing $ is handled by regexCompile
+    if (rc->p[0] == '$' && rc->p[1] == '\0')
+      break;
+    node = reAddNode(rc, RE_CAT, node, reParseRepeat(rc));
+  }
+  return node;
+}
+
+int reParseAlt(struct recompiler *rc) {
+  int node = reParseCat(rc);
+  while (*rc->p == '|' && !rc->error) {
+    rc->p++;
+    node = reAddNode(rc, RE_ALT, node, reParseCat(rc));
+  }
+  return node;
+}
+
+int reAddState(struct recompiler *rc, int type, int out, int out1, int set) {
+  rc->states = realloc(rc->states, sizeof(restate) * (rc->nstates + 1));
+  if (rc->states == NULL)
+    die("realloc");
+  rc->states[rc->nstates] = (restate){type, out, out1, set};
+  return rc->nstates++;
+}
+
+// Builds the NFA for `node` that continues on to state `next`, and returns
+// its first state. With `reverse` set it matches the text backwards.
+int reCompileNode(struct recompiler *rc, int node, int next, int reverse) {
+  renode *n = &rc->nodes[node];
+  int a = n->a, b = n->b, s;
+
+  switch (n->type) {
+  case RE_SET:
+    return reAddState(rc, NS_SET, next, -1, n->set);
+  case RE_CAT:
+    if (reverse)
+      return reCompileNode(rc, b, reCompileNode(rc, a, next, reverse),
+                           reverse);
+    return reCompileNode(rc, a, reCompileNode(rc, b, next, reverse), reverse);
+  case RE_ALT:
+    s = reCompileNode(rc, a, next, reverse);
+    return reAddState(rc, NS_SPLIT, s, reCompileNode(rc, b, next, reverse),
+                      -1);
+  case RE_STAR:
+  case RE_PLUS:
+    // Loop back to a split that either goes around again or moves on. We
+    // can't assign straight into `states` as compiling may realloc it.
+    s = reAddState(rc, NS_SPLIT, -1, next, -1);
+    a = reCompileNode(rc, a, s, reverse);
+    rc->states[s].out = a;
+    return n->type == RE_STAR ? s : a;
+  case RE_QUEST:
+    s = reCompileNode(rc, a, next, reverse);
+    return reAddState(rc, NS_SPLIT, s, next, -1);
+  default:
+    return next;
+  }
+}
+
+// Adds the states reachable from `state` without consuming anything to
+// `bits`. Splits seen since `gen` was last bumped are skipped so loops made
+// of nothing but splits terminate.
+void reClosure(struct recompiler *rc, int state, uint64_t *bits) {
+  while (state != -1) {
+    restate *s = &rc->states[state];
+    if (s->type == NS_SPLIT) {
+      if (rc->mark[state] == rc->gen)
+        return;
+      rc->mark[state] = rc->gen;
+    }
+    if (s->type != NS_SPLIT) {
+      bits[state / 64] |= (uint64_t)1 << (state % 64);
+      return;
+    }
+    reClosure(rc, s->out, bits);
+    state = s->out1;
+  }
+}
+
+uint64_t reHashBits(uint64_t *bits, int words) {
+  // FNV-1a, a word at a time
+  uint64_t h = 14695981039346656037ULL;
+  for (int w = 0; w < words; w++)
+    h = (h ^ bits[w]) * 1099511628211ULL;
+  return h;
+}
+
+// Turns the NFA starting at state `start` into a DFA. If `restart` is set the
+// pattern may begin at any position, i.e. the start state gets mixed back in
+// after every byte, and `hold` asks for the table that doesn't do that too.
+int reBuildDfa(struct recompiler *rc, int start, int restart, int hold,
+               dfa *d) {
+  // Bytes that every set treats the same can share a column in the table
+  memset(d->classmap, 0, sizeof(d->classmap));
+  d->nclasses = 1;
+  for (int j = 0; j < rc->nsets; j++) {
+    int split[256][2];
+    memset(split, -1, sizeof(split));
+    int n = 0;
+    for (int c = 0; c < 256; c++) {
+      int in = reSetHas(rc->sets[j], c) != 0;
+      if (split[d->classmap[c]][in] == -1)
+        split[d->classmap[c]][in] = n++;
+      d->classmap[(unsigned char)c] = split[d->classmap[c]][in];
+    }
+    d->nclasses = n;
+  }
+  unsigned char rep[256];
+  for (int c = 255; c >= 0; c--)
+    rep[d->classmap[c]] = c;
+
+  int words = (rc->nstates + 63) / 64;
+  uint64_t *startbits = calloc(words, sizeof(uint64_t));
+  if (startbits == NULL)
+    die("calloc");
+  rc->gen++;
+  reClosure(rc, start, startbits);
+
+  // DFA states are sets of NFA states, found again through a hash table
+  int hashsize = RE_MAX_STATES * 2;
+  int *hash = malloc(sizeof(int) * hashsize);
+  uint64_t *bits = malloc(sizeof(uint64_t) * words * (RE_MAX_STATES + 1));
+  d->trans = malloc(sizeof(int) * d->nclasses * RE_MAX_STATES);
+  d->hold = restart && hold
+                ? malloc(sizeof(int) * d->nclasses * RE_MAX_STATES)
+                : NULL;
+  d->accept = malloc(RE_MAX_STATES);
+  d->dead = malloc(RE_MAX_STATES);
+  if (hash == NULL || bits == NULL || d->trans == NULL || d->accept == NULL ||
+      d->dead == NULL || (restart && hold && d->hold == NULL))
+    die("malloc");
+  memset(hash, -1, sizeof(int) * hashsize);
+  d->nstates = 0;
+
+  // State 0 is where we start, every state we find gets its transitions
+  // filled in in turn. The slot after the last state is used as scratch
+  // space for building the next one.
+  memcpy(bits, startbits, sizeof(uint64_t) * words);
+  hash[reHashBits(bits, words) % hashsize] = 0;
+  d->nstates = 1;
+
+  int ok = 1;
+  for (int i = 0; i < d->nstates && ok; i++) {
+    uint64_t *cur = &bits[words * i];
+    d->accept[i] = 0;
+    d->dead[i] = 1;
+    for (int st = 0; st < rc->nstates; st++) {
+      if (!(cur[st / 64] & ((uint64_t)1 << (st % 64))))
+        continue;
+      d->dead[i] = 0;
+      if (rc->states[st].type == NS_MATCH)
+        d->accept[i] = 1;
+    }
+
+    for (int t = 0; t < (d->hold ? 2 : 1) * d->nclasses && ok; t++) {
+      int k = t % d->nclasses;
+      uint64_t *next = &bits[words * d->nstates];
+      if (restart && t < d->nclasses)
+        memcpy(next, startbits, sizeof(uint64_t) * words);
+      else
+        memset(next, 0, sizeof(uint64_t) * words);
+      rc->gen++;
+      for (int st = 0; st < rc->nstates; st++) {
+        if (!(cur[st / 64] & ((uint64_t)1 << (st % 64))))
+          continue;
+        restate *s = &rc->states[st];
+        if (s->type == NS_SET && reSetHas(rc->sets[s->set], rep[k]))
+          reClosure(rc, s->out, next);
+      }
+
+      int slot = reHashBits(next, words) % hashsize;
+      while (hash[slot] != -1 &&
+             memcmp(&bits[words * hash[slot]], next,
+                    sizeof(uint64_t) * words) != 0)
+        slot = (slot + 1) % hashsize;
+
+      if (hash[slot] == -1) {
+        if (d->nstates == RE_MAX_STATES) {
+          ok = 0;
+          break;
+        }
+        hash[slot] = d->nstates++;
+      }
+      if (t < d->nclasses)
+        d->trans[i * d->nclasses + k] = hash[slot];
+      else
+        d->hold[i * d->nclasses + k] = hash[slot];
+    }
+  }
+
+  free(hash);
+  free(bits);
+  free(startbits);
+  return ok;
+}
+
+void regexFree(regex *re) {
+  free(re->fwd.trans);
+  free(re->fwd.hold);
+  free(re->fwd.accept);
+  free(re->fwd.dead);
+  free(re->rev.trans);
+  free(re->rev.accept);
+  free(re->rev.dead);
+  free(re->anchored.trans);
+  free(re->anchored.accept);
+  free(re->anchored.dead);
+  memset(re, 0, sizeof(regex));
+}
+
+// Compiles `pattern` into `re`, returns NULL or a description of what's wrong
+// with the pattern
+const char *regexCompile(regex *re, const char *pattern) {
+  struct recompiler rc;
+  memset(&rc, 0, sizeof(rc));
+  memset(re, 0, sizeof(regex));
+
+  rc.p = pattern;
+  if (*rc.p == '^') {
+    re->bol = 1;
+    rc.p++;
+  }
+  int root = reParseAlt(&rc);
+  if (!rc.error && rc.p[0] == '$' && rc.p[1] == '\0') {
+    re->eol = 1;
+    rc.p++;
+  }
+  if (!rc.error && *rc.p)
+    rc.error = "unmatched )";
+
+  if (!rc.error) {
+    int match = reAddState(&rc, NS_MATCH, -1, -1, -1);
+    int fwd = reCompileNode(&rc, root, match, 0);
+    int rev = reCompileNode(&rc, root, match, 1);
+    rc.mark = calloc(rc.nstates, sizeof(int));
+    if (rc.mark == NULL)
+      die("calloc");
+    if (!reBuildDfa(&rc, fwd, !re->bol, 1, &re->fwd) ||
+        !reBuildDfa(&rc, rev, !re->eol, 0, &re->rev) ||
+        !reBuildDfa(&rc, fwd, 0, 0, &re->anchored))
+      rc.error = "pattern too complex";
+    else if (re->fwd.accept[0])
+      rc.error = "pattern matches empty text";
+  }
+
+  free(rc.nodes);
+  free(rc.sets);
+  free(rc.states);
+  free(rc.mark);
+  if (rc.error)
+    regexFree(re);
+  return rc.error;
+}
+
+// Finds the leftmost match in s[from, len), and the longest of those starting
+// there. Returns its start and sets `*mlen` to its length, or returns -1 if
+// there is none.
+int regexFind(regex *re, const char *s, int len, int from, int *mlen) {
+  if (re->bol && from > 0)
+    return -1;
+
+  dfa *d;
+  int st, start = 0, end = -1, j;
+  if (!re->bol) {
+    // Run forwards until the earliest point a match can end. The leftmost
+    // match started before then, so from there on the matches under way are
+    // carried on without starting new ones, to find how far any of them goes.
+    d = &re->fwd;
+    int *trans = d->trans;
+    st = 0;
+    for (j = from; j < len && !d->dead[st]; j++) {
+      st = trans[st * d->nclasses + d->classmap[(unsigned char)s[j]]];
+      if (d->accept[st] && !re->eol) {
+        end = j + 1;
+        trans = d->hold;
+      }
+    }
+    if (re->eol && j == len && d->accept[st])
+      end = len;
+    if (end == -1)
+      return -1;
+
+    // Then backwards for the leftmost start of a match ending no later,
+    // without going into text we already searched
+    d = &re->rev;
+    st = 0;
+    for (j = end - 1; j >= from && !d->dead[st]; j--) {
+      st = d->trans[st * d->nclasses + d->classmap[(unsigned char)s[j]]];
+      if (d->accept[st])
+        start = j;
+    }
+  }
+
+  // And forwards from that start for the longest match
+  d = &re->anchored;
+  st = 0;
+  end = -1;
+  for (j = start; j < len && !d->dead[st]; j++) {
+    st = d->trans[st * d->nclasses + d->classmap[(unsigned char)s[j]]];
+    if (d->accept[st] && !re->eol)
+      end = j + 1;
+  }
+  if (re->eol && j == len && d->accept[st])
+    end = len;
+  if (end == -1)
+    return -1;
+
+  *mlen = end - start;
+  return start;
+}
+
+/* Find */
+
+// Rows scanned by each task of a background search
+#define FIND_CHUNK_ROWS 8192
+
+// Where a match starts, `col` being an index into the row's `chars`
+typedef struct searchhit {
+  int row;
+  int col;
+  int len;
+} searchhit;
+
+typedef struct hitlist {
+  searchhit *hits;
+  int numhits;
+  int hitcap;
+} hitlist;
+
+// Hits found by one task of a background search, `done` is set (under the
+// pool's lock) once the task has finished with them
+typedef struct findchunk {
+  hitlist found;
+  int done;
+} findchunk;
+
+// State kept for the duration of a single editorFind prompt
+struct editorSearch {
+  // The query `hits` were collected for
+  char *query;
+  int qlen;
+  // Boyer-Moore-Horspool shift for each byte value, see findInRow
+  int skip[256];
+  // Whether the query is a regex, and if so what it compiled to or why it
+  // didn't
+  int regex;
+  regex re;
+  const char *error;
+  // Matches in the file, in order. While a scan is running this only holds
+  // the hits of the chunks before `merged`.
+  hitlist found;
+  // Index into `hits` of the match the cursor is on, -1 if there is none
+  int current;
+  // The scan running in the background, if `scanning` is set
+  struct workbatch batch;
+  findchunk *chunks;
+  int nchunks;
+  int merged;
+  int scanning;
+};
+
+struct editorSearch search;
+
+void findSetQuery(const char *query) {
+  search.qlen = strlen(query);
+  free(search.query);
+  search.query = strdup(query);
+
+  regexFree(&search.re);
+  search.error = NULL;
+  if (search.regex && search.qlen)
+    search.error = regexCompile(&search.re, query);
+
+  // On a mismatch we can move the window along until the last byte under it
+  // lines up with that byte's last occurrence in the query (ignoring the
+  // query's last byte itself)
+  for (int c = 0; c < 256; c++)
+    search.skip[c] = search.qlen;
+  for (int j = 0; j < search.qlen - 1; j++)
+    search.skip[(unsigned char)search.query[j]] = search.qlen - 1 - j;
+}
+
+// Returns the first match of the query in s[0, len), or NULL
+char *findInRow(char *s, int len) {
+  int m = search.qlen;
+  if (m > len)
+    return NULL;
+  if (m == 1)
+    return memchr(s, search.query[0], len);
+
+  char last = search.query[m - 1];
+  for (int i = 0; i <= len - m;) {
+    char c = s[i + m - 1];
+    if (c == last && memcmp(&s[i], search.query, m - 1) == 0)
+      return &s[i];
+    i += search.skip[(unsigned char)c];
+  }
+  return NULL;
+}
+
+// Finds the first match in s[from, len). Returns its start and sets `*mlen`
+// to its length, or returns -1 if there is none.
+int findNext(char *s, int len, int from, int *mlen) {
+  if (search.regex)
+    return regexFind(&search.re, s, len, from, mlen);
+
+  char *match = findInRow(&s[from], len - from);
+  *mlen = search.qlen;
+  return match ? match - s : -1;
+}
+
+void findAddHit(hitlist *list, int row, int col, int len) {
+  if (list->numhits == list->hitcap) {
+    list->hitcap = list->hitcap ? list->hitcap * 2 : 64;
+    list->hits = realloc(list->hits, sizeof(searchhit) * list->hitcap);
+    if (list->hits == NULL)
+      die("realloc");
+  }
+  list->hits[list->numhits].row = row;
+  list->hits[list->numhits].col = col;
+  list->hits[list->numhits].len = len;
+  list->numhits++;
+}
+
+// Runs on the worker pool, collects the matches in one chunk of rows. The
+// buffer can't change under us as nothing gets edited while the search
+// prompt is up, and editorFind waits for us before it returns.
+void findScanChunk(void *unused, int task) {
+  (void)unused;
+  findchunk *chunk = &search.chunks[task];
+  int from = task * FIND_CHUNK_ROWS;
+  int to = from + FIND_CHUNK_ROWS < E.numrows ? from + FIND_CHUNK_ROWS
+                                               : E.numrows;
+
+  rowiter it;
+  editorRowIterInit(&it, from);
+  for (int at = from; at < to; at++) {
+    if (at % 1024 == 0 && poolCancelled(&search.batch))
+      break;
+
+    int size;
+    char *s = editorRowIterText(&it, &size);
+    int col = 0, len;
+    while ((col = findNext(s, size, col, &len)) != -1) {
+      findAddHit(&chunk->found, at, col, len);
+      col += len;
     }
   }
+
+  pthread_mutex_lock(&pool.lock);
+  chunk->done = 1;
+  pthread_mutex_unlock(&pool.lock);
+  editorWakeup();
+}
+
+// Stops the background scan, if there is one, and drops its results
+void findStop() {
+  if (search.chunks) {
+    poolCancel(&search.batch);
+    for (int j = 0; j < search.nchunks; j++)
+      free(search.chunks[j].found.hits);
+    free(search.chunks);
+    search.chunks = NULL;
+  }
+  search.nchunks = search.merged = search.scanning = 0;
+}
+
+// Starts collecting every match in the file on the worker pool
+void findScan() {
+  findStop();
+  search.found.numhits = 0;
+  if (search.qlen == 0 || search.error)
+    return;
+
+  search.nchunks = (E.numrows + FIND_CHUNK_ROWS - 1) / FIND_CHUNK_ROWS;
+  search.chunks = calloc(search.nchunks, sizeof(findchunk));
+  if (search.chunks == NULL)
+    die("calloc");
+  search.scanning = 1;
+  poolSubmit(&search.batch, findScanChunk, NULL, search.nchunks);
+}
+
+// Appends the hits of chunks that finished, in order, to `found`
+void findCollect() {
+  if (!search.scanning)
+    return;
+
+  pthread_mutex_lock(&pool.lock);
+  while (search.merged < search.nchunks && search.chunks[search.merged].done) {
+    hitlist *chunk = &search.chunks[search.merged].found;
+    for (int j = 0; j < chunk->numhits; j++)
+      findAddHit(&search.found, chunk->hits[j].row, chunk->hits[j].col,
+                 chunk->hits[j].len);
+    free(chunk->hits);
+    chunk->hits = NULL;
+    search.merged++;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (search.merged == search.nchunks)
+    findStop();
+}
+
+// Typing one more char can only narrow things down, so rather than scanning
+// the file again we check which of the previous hits are still matches
+void findRefine() {
+  int kept = 0;
+  for (int j = 0; j < search.found.numhits; j++) {
+    searchhit *hit = &search.found.hits[j];
+    erow *row = editorRowAt(hit->row);
+    if (row->size - hit->col >= search.qlen &&
+        memcmp(&row->chars[hit->col], search.query, search.qlen) == 0)
+      search.found.hits[kept++] = *hit;
+  }
+  search.found.numhits = kept;
+}
+
+// Index of the first hit at or after (cy, cx), or `numhits` if there is none
+int findHitFrom(int cy, int cx) {
+  int lo = 0, hi = search.found.numhits;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    searchhit *hit = &search.found.hits[mid];
+    if (hit->row < cy || (hit->row == cy && hit->col < cx))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Resets the search to its initial state for next time
+void findClear() {
+  findStop();
+  free(search.query);
+  search.query = NULL;
+  search.found.numhits = 0;
+  search.current = -1;
+  regexFree(&search.re);
+  search.error = NULL;
+}
+
+void editorFindCallback(char *query, int key) {
+  // Where the cursor was when the user started typing the query
+  static int start_cy = 0, start_cx = 0;
+
+  findCollect();
+
+  if (key == '\r' || key == '\x1b') {
+    findClear();
+    return;
+  }
+
+  // Switching between literal and regex matching means starting over. The
+  // scan under way reads the query, so it has to be stopped before that
+  // changes.
+  int toggled = key == CTRL_KEY('e');
+  if (toggled) {
+    findStop();
+    search.regex = !search.regex;
+  }
+
+  int current = search.current;
+  if (search.query == NULL) {
+    start_cy = E.cy;
+    start_cx = E.cx;
+    current = -1;
+  }
+
+  if (search.query == NULL || toggled || strcmp(query, search.query) != 0) {
+    int extends = search.query && search.qlen > 0 && !search.scanning &&
+                  !search.regex && !toggled &&
+                  strncmp(query, search.query, search.qlen) == 0;
+    findStop();
+    findSetQuery(query);
+    if (extends)
+      findRefine();
+    else
+      findScan();
+    search.current = -1;
+  } else if (search.current != -1) {
+    // We support wrapping around (both sides)
+    int n = search.found.numhits;
+    if (key == ARROW_RIGHT || key == ARROW_DOWN)
+      search.current = (search.current + 1) % n;
+    else if (key == ARROW_LEFT || key == ARROW_UP)
+      search.current = (search.current + n - 1) % n;
+  }
+
+  // Jump to the first match after where we started. Until the scan is over
+  // we can't tell if there is one, we only wrap around once it is.
+  if (search.current == -1 && search.found.numhits) {
+    int first = findHitFrom(start_cy, start_cx);
+    if (first < search.found.numhits)
+      search.current = first;
+    else if (!search.scanning)
+      search.current = 0;
+  }
+
+  if (search.current != -1 && search.current != current) {
+    E.cy = search.found.hits[search.current].row;
+    E.cx = search.found.hits[search.current].col;
+
+    // A hack so that editorScroll will put the matching line at the top
+    // at the next refresh
+    E.rowoff = E.numrows;
+  }
 }
 
 void editorFind() {
@@ -610,9 +4654,11 @@ void editorFind() {
   int saved_cy = E.cy;
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
+  int saved_wrapoff = E.wrapoff;
 
   char *query =
-      editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+      editorPrompt("Search: %s (ESC/Arrows/Enter, Ctrl-E regex)",
+                   editorFindCallback, 0);
   if (query)
     free(query);
   else {
@@ -621,36 +4667,982 @@ void editorFind() {
     E.cy = saved_cy;
     E.coloff = saved_coloff;
     E.rowoff = saved_rowoff;
+    E.wrapoff = saved_wrapoff;
+  }
+}
+
+// Replaces every match of `query` with `with`, which can't span lines, and
+// returns how many there were. Each row with matches is rewritten into one
+// new block and rendered again once, and it's all undone in one go.
+int editorReplaceAll(char *query, char *with, int withlen) {
+  int regex = search.regex;
+  search.regex = 0;
+  findSetQuery(query);
+  findScan();
+  if (search.scanning) {
+    poolWait(&search.batch);
+    findCollect();
+  }
+  search.regex = regex;
+
+  int n = search.found.numhits;
+  if (n)
+    editorSyntaxInvalidate(search.found.hits[0].row);
+  editorUndoBreak();
+  undo.group++;
+  for (int j = 0; j < n;) {
+    searchhit *hits = &search.found.hits[j];
+    int at = hits[0].row;
+    erow *row = editorRowAt(at);
+    int size = row->size, k = 0;
+    for (; j + k < n && hits[k].row == at; k++)
+      size += withlen - hits[k].len;
+
+    int cap;
+    char *chars = arenaAlloc(&E.arena, size + 1, &cap);
+    int from = 0, len = 0;
+    for (int m = 0; m < k; m++) {
+      memcpy(&chars[len], &row->chars[from], hits[m].col - from);
+      len += hits[m].col - from;
+      editorUndoRecord(UNDO_DELETE, at, len, &row->chars[hits[m].col],
+                       hits[m].len);
+      if (withlen)
+        editorUndoRecord(UNDO_INSERT, at, len, with, withlen);
+      memcpy(&chars[len], with, withlen);
+      len += withlen;
+      from = hits[m].col + hits[m].len;
+    }
+    memcpy(&chars[len], &row->chars[from], row->size - from);
+    chars[size] = '\0';
+
+    editorRowFreeChars(row);
+    row->chars = chars;
+    row->ccap = cap;
+    row->gen = savejob.gen;
+    row->size = size;
+    row->hl_start = HLS_STALE;
+    if (row->render)
+      editorUpdateRow(row);
+    editorWrapUpdate(at);
+    E.dirty++;
+    j += k;
+  }
+  findClear();
+
+  erow *row = editorRowAt(E.cy);
+  if (row && E.cx > row->size)
+    E.cx = row->size;
+  return n;
+}
+
+void editorReplace() {
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL, 0);
+  if (query == NULL)
+    return;
+  char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+  if (with) {
+    int n = editorReplaceAll(query, with, strlen(with));
+    editorSetStatusMessage("Replaced %d match%s", n, n == 1 ? "" : "es");
+  }
+  free(query);
+  free(with);
+}
+
+/* Follow mode */
+
+// Most we read in one go when the file we follow grows, so that a burst of
+// output doesn't keep us from getting back to the user
+#define FOLLOW_MAX_READ (64 << 20)
+
+// Keeps adding rows for whatever gets appended to the open file, like
+// `tail -f`. New data is read into blocks from the arena that the rows then
+// point into, the same way rows point into the mapping.
+struct editorFollow {
+  // -1 unless we are following
+  int fd;
+  // How much of the file we've turned into rows so far
+  off_t off;
+  // The last line if it didn't have its newline yet, and how long it was
+  // before stripping any \r
+  char *partial;
+  size_t partiallen;
+  // Tells us when the file changes if we can, otherwise we check every
+  // FOLLOW_POLL_MS. `pending` is set when we know there's more to read but
+  // couldn't get to it yet.
+  int inotify;
+  int pending;
+};
+
+struct editorFollow follow = {-1, 0, NULL, 0, -1, 0};
+
+void editorFollowStart() {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1 ||
+      !S_ISREG(st.st_mode)) {
+    editorSetStatusMessage("Can only follow regular files");
+    return;
+  }
+  follow.fd = open(E.filename, O_RDONLY);
+  if (follow.fd == -1)
+    die("open");
+  follow.off = E.maplen;
+  follow.partial = NULL;
+  follow.pending = 0;
+#ifdef __linux__
+  follow.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (follow.inotify != -1 &&
+      inotify_add_watch(follow.inotify, E.filename, IN_MODIFY) == -1) {
+    close(follow.inotify);
+    follow.inotify = -1;
+  }
+#endif
+  if (E.maplen && E.map[E.maplen - 1] != '\n') {
+    erow *last = editorRowAt(E.numrows - 1);
+    follow.partial = last->chars;
+    follow.partiallen = E.map + E.maplen - last->chars;
+  }
+}
+
+void editorFollowStop() {
+  if (follow.fd == -1)
+    return;
+  close(follow.fd);
+  follow.fd = -1;
+  follow.partial = NULL;
+  if (follow.inotify != -1) {
+    close(follow.inotify);
+    follow.inotify = -1;
+  }
+}
+
+// Checks whether the file grew and adds rows for what was appended, returns
+// whether there's anything new to draw. If the cursor was on the last row it
+// moves along to the new last row.
+int editorFollowPoll() {
+  if (follow.fd == -1)
+    return 0;
+  // We go by the size of the file, all the notifications have to say is that
+  // it's worth checking
+  if (follow.inotify != -1) {
+    char buf[4096];
+    while (read(follow.inotify, buf, sizeof(buf)) > 0)
+      ;
+  }
+  // Rows can't be added under a search scanning them or looking at its hits
+  if (search.query || search.scanning) {
+    follow.pending = 1;
+    return 0;
+  }
+  follow.pending = 0;
+
+  struct stat st;
+  if (fstat(follow.fd, &st) == -1 || st.st_size == follow.off)
+    return 0;
+  int atend = E.cy >= E.numrows - 1;
+  int pastend = E.cy == E.numrows;
+  if (st.st_size < follow.off) {
+    // Most likely the log got rotated. The lines we had are gone from the
+    // file, and what the mapping had of them with it, so the rows go too
+    // and everything in it now gets read from the start.
+    editorSaveFinish(1);
+    editorSyntaxStop();
+    journalFlush();
+    journalClose(&journal, E.dirty);
+    editorDropRows();
+    follow.off = 0;
+    follow.partial = NULL;
+    editorSetStatusMessage("%s got truncated", E.filename);
+    if (st.st_size == 0)
+      return 1;
+  }
+
+  // An unfinished line we showed gets finished off by what was appended, as
+  // long as it is still there the way we left it
+  erow *last = editorRowAt(E.numrows - 1);
+  int rejoin = follow.partial && last && last->ccap == 0 &&
+               last->chars == follow.partial;
+  size_t keep = rejoin ? follow.partiallen : 0;
+
+  size_t n = st.st_size - follow.off;
+  if (n > FOLLOW_MAX_READ)
+    n = FOLLOW_MAX_READ;
+  int cap;
+  char *block = arenaAlloc(&E.arena, keep + n, &cap);
+  if (keep)
+    memcpy(block, follow.partial, keep);
+  ssize_t got = pread(follow.fd, block + keep, n, follow.off);
+  if (got <= 0) {
+    arenaFree(&E.arena, block, cap);
+    return 0;
+  }
+  follow.off += got;
+  if (follow.off < st.st_size)
+    follow.pending = 1;
+
+  editorSyntaxInvalidate(E.numrows - 1);
+  int cy = E.cy;
+
+  char *p = block;
+  char *end = block + keep + got;
+  follow.partial = NULL;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    if (rejoin) {
+      // The row keeps its render buffers, only what it shows changes
+      last->chars = p;
+      last->size = eol - p;
+      last->hl_start = HLS_STALE;
+      while (last->size > 0 && p[last->size - 1] == '\r')
+        last->size--;
+      if (last->render)
+        editorUpdateRow(last);
+      rejoin = 0;
+    } else {
+      erow row;
+      editorRowFromLine(&row, p, eol);
+      rowtreeInsertRow(E.numrows++, &row);
+    }
+    editorWrapUpdate(E.numrows - 1);
+    if (nl == NULL) {
+      follow.partial = p;
+      follow.partiallen = end - p;
+    }
+    p = eol + 1;
+  }
+
+  if (atend) {
+    E.cy = pastend ? E.numrows : E.numrows - 1;
+    if (E.cy != cy)
+      E.cx = 0;
+  }
+  return 1;
+}
+
+/* Pager */
+
+// How many rows are kept around the cursor, how many lines apart the index
+// marks are, and how much of a line gets shown at most
+#define PAGER_WINDOW 4096
+#define PAGER_MARK_LINES 4096
+#define PAGER_LINE_MAX (1 << 20)
+
+// With -r, rows only exist for a window of lines around the cursor, sliding
+// along as it moves. Row numbers (`E.cy`, `E.rowoff`, ...) count from the
+// first line of the window. Where lines start is only looked up in a sparse
+// index, so memory stays the same however big the file. The file stays
+// mapped, and the kernel is free to drop what we haven't looked at lately.
+struct editorPager {
+  int on;
+  // The part of the mapping the window's rows come from, and the line the
+  // first of them is, or -1 if we don't know
+  size_t start, end;
+  long long firstline;
+  // Line `k * PAGER_MARK_LINES` starts at `marks[k]`. The first `lines`
+  // lines have been counted, which took us up to byte `indexed`.
+  size_t *marks;
+  long long nmarks, markcap;
+  long long lines;
+  size_t indexed;
+};
+
+struct editorPager pager;
+
+// Where the line containing byte `at` starts
+size_t pagerLineStart(size_t at) {
+  char *nl = at ? memrchr(E.map, '\n', at) : NULL;
+  return nl ? nl - E.map + 1 : 0;
+}
+
+// Where the line starting at `from` ends, i.e. its newline or the end of file
+size_t pagerLineEnd(size_t from) {
+  char *nl = memchr(E.map + from, '\n', E.maplen - from);
+  return nl ? (size_t)(nl - E.map) : E.maplen;
+}
+
+void pagerInsertRow(int at, size_t from, size_t eol) {
+  if (eol - from > PAGER_LINE_MAX)
+    eol = from + PAGER_LINE_MAX;
+  erow row;
+  editorRowFromLine(&row, E.map + from, E.map + eol);
+  rowtreeInsertRow(at, &row);
+  E.numrows++;
+  editorWrapUpdate(at);
+}
+
+void pagerDeleteRow(int at) {
+  erow row;
+  rowtreeDeleteRow(at, &row);
+  editorFreeRow(&row);
+  E.numrows--;
+}
+
+// Moves the window a line forward or back
+void pagerForward() {
+  size_t eol = pagerLineEnd(pager.end);
+  pagerInsertRow(E.numrows, pager.end, eol);
+  pager.end = eol < E.maplen ? eol + 1 : eol;
+  if (E.numrows <= PAGER_WINDOW)
+    return;
+  pagerDeleteRow(0);
+  pager.start = pagerLineEnd(pager.start) + 1;
+  if (pager.firstline >= 0)
+    pager.firstline++;
+  E.cy--;
+  E.rowoff--;
+  E.frame_rowoff--;
+}
+
+void pagerBack() {
+  size_t from = pagerLineStart(pager.start - 1);
+  pagerInsertRow(0, from, pager.start - 1);
+  pager.start = from;
+  if (pager.firstline >= 0)
+    pager.firstline--;
+  E.cy++;
+  E.rowoff++;
+  E.frame_rowoff++;
+  if (E.numrows <= PAGER_WINDOW)
+    return;
+  pagerDeleteRow(E.numrows - 1);
+  pager.end = pagerLineStart(pager.end - 1);
+}
+
+// Keeps the cursor away from the ends of the window, unless that's where
+// the file ends too
+void pagerSlide() {
+  int margin = PAGER_WINDOW / 4;
+  if (!pager.on || ((E.cy >= margin || pager.start == 0) &&
+                    (E.cy <= E.numrows - margin || pager.end == E.maplen)))
+    return;
+  editorSyntaxInvalidate(0);
+  // Scrolling the frame isn't worth the trouble when wrapping, the rows
+  // going and coming change how many lines there are before the top
+  if (E.wrap)
+    E.frame_valid = 0;
+  while (E.cy < PAGER_WINDOW / 2 && pager.start > 0)
+    pagerBack();
+  while (E.cy > E.numrows - PAGER_WINDOW / 2 && pager.end < E.maplen)
+    pagerForward();
+}
+
+// Fills the window with the lines from `from` on, `line` being the first
+// of them if we know
+void pagerLoad(size_t from, long long line) {
+  editorSyntaxInvalidate(0);
+  while (E.numrows)
+    pagerDeleteRow(E.numrows - 1);
+  pager.start = pager.end = from;
+  pager.firstline = line;
+  E.cy = E.cx = E.rowoff = E.coloff = E.wrapoff = 0;
+  while (E.numrows < PAGER_WINDOW / 2 && pager.end < E.maplen)
+    pagerForward();
+  // Near the end of the file look back instead
+  while (E.numrows < PAGER_WINDOW / 2 && pager.start > 0)
+    pagerBack();
+  E.frame_valid = 0;
+}
+
+// Counts lines from where we got to last time, until past line `line` or
+// byte `offset`, whichever is first, or until the end of the file
+void pagerIndexTo(long long line, size_t offset) {
+  while (pager.indexed < E.maplen &&
+         (pager.lines <= line || pager.indexed <= offset)) {
+    if (pager.lines % PAGER_MARK_LINES == 0) {
+      if (pager.nmarks == pager.markcap) {
+        pager.markcap = pager.markcap ? pager.markcap * 2 : 1024;
+        pager.marks = realloc(pager.marks, sizeof(size_t) * pager.markcap);
+        if (pager.marks == NULL)
+          die("realloc");
+      }
+      pager.marks[pager.nmarks++] = pager.indexed;
+    }
+    size_t eol = pagerLineEnd(pager.indexed);
+    pager.indexed = eol < E.maplen ? eol + 1 : eol;
+    pager.lines++;
+  }
+}
+
+// Where line `line` starts, counting as far as we have to. Lines past the
+// end are taken to mean the last one.
+size_t pagerFindLine(long long *line) {
+  pagerIndexTo(*line, 0);
+  if (*line >= pager.lines)
+    *line = pager.lines ? pager.lines - 1 : 0;
+  size_t at = pager.marks[*line / PAGER_MARK_LINES];
+  for (long long n = *line % PAGER_MARK_LINES; n > 0; n--)
+    at = pagerLineEnd(at) + 1;
+  return at;
+}
+
+// The line that starts at `at`, -1 if we haven't counted that far
+long long pagerLineOf(size_t at) {
+  if (at >= pager.indexed)
+    return at == E.maplen && pager.indexed == E.maplen ? pager.lines : -1;
+  long long lo = 0, hi = pager.nmarks - 1;
+  while (lo < hi) {
+    long long mid = (lo + hi + 1) / 2;
+    if (pager.marks[mid] <= at)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  long long line = lo * PAGER_MARK_LINES;
+  for (size_t p = pager.marks[lo]; p < at; p = pagerLineEnd(p) + 1)
+    line++;
+  return line;
+}
+
+// Opens the mapped file in the pager rather than making a row for each line
+void pagerOpen() {
+  pager.on = 1;
+  pagerIndexTo(0, 0);
+  pagerLoad(0, 0);
+}
+
+void pagerClose() {
+  free(pager.marks);
+  memset(&pager, 0, sizeof(pager));
+}
+
+// The line row `at` of the window is for the status bar, or the byte it
+// starts at if we don't know
+void pagerDescribe(char *buf, int len, int at) {
+  erow *row = editorRowAt(at);
+  if (pager.firstline >= 0)
+    snprintf(buf, len, "%lld", pager.firstline + at);
+  else
+    snprintf(buf, len, "@%zu", row ? (size_t)(row->chars - E.map) : E.maplen);
+}
+
+// Asks where to go: a line number, @ and a byte offset, a percentage of the
+// way through or $ for the end. Without -r only line numbers and $ work.
+void editorGoto() {
+  char *where = editorPrompt("Go to: %s (line, @byte, N%% or $, ESC to cancel)",
+                             NULL, 0);
+  if (where == NULL)
+    return;
+  char *end;
+  long long n = strtoll(where[0] == '@' ? &where[1] : where, &end, 10);
+  int percent = *end == '%';
+  int bytes = where[0] == '@' || percent;
+  if (strcmp(where, "$") == 0) {
+    n = bytes = percent = 0;
+    if (pager.on) {
+      bytes = 1;
+      n = E.maplen;
+    } else {
+      n = E.numrows - 1;
+    }
+  } else if (end == where || (*end && strcmp(end, "%") != 0) || n < 0) {
+    editorSetStatusMessage("Don't know where %s is", where);
+    free(where);
+    return;
+  }
+  free(where);
+
+  if (!pager.on) {
+    if (bytes) {
+      editorSetStatusMessage("Bytes and percentages need -r");
+      return;
+    }
+    E.cy = n < E.numrows ? n : E.numrows ? E.numrows - 1 : 0;
+    E.cx = 0;
+    E.rowoff = E.numrows;
+    return;
+  }
+
+  size_t at;
+  long long line = n;
+  if (bytes) {
+    if (percent)
+      n = n >= 100 ? (long long)E.maplen : (long long)(E.maplen / 100 * n);
+    at = pagerLineStart((size_t)n < E.maplen ? (size_t)n : E.maplen - 1);
+    line = pagerLineOf(at);
+  } else {
+    at = pagerFindLine(&line);
+  }
+  pagerLoad(at, line);
+  // Put the line at the top of the screen, like a search hit
+  E.cy = 0;
+  for (erow *row; (row = editorRowAt(E.cy)) && row->chars < E.map + at;)
+    E.cy++;
+  E.rowoff = E.numrows;
+}
+
+/* Buffers */
+
+// What E and the per-file globals hold about each open file but the one
+// being edited. Switching swaps this in and out, the rows stay where they
+// are in their tree and the arena, so nothing is read or rendered again.
+struct editorBuffer {
+  int cx, cy, rowoff, coloff;
+  int wrap, wrapoff;
+  // The screen width row heights were worked out for
+  int wrapcols;
+  int numrows;
+  rownode *rows;
+  char *map;
+  size_t maplen;
+  int dirty;
+  int readonly;
+  char *filename;
+  struct editorSyntax *syntax;
+  int hl_valid;
+  struct editorUndo undo;
+  struct editorPager pager;
+  struct editorJournal journal;
+};
+
+// There are `E.nbuffers` of them, what's kept for `cur` is out of date as
+// that one is in E
+struct editorBuffers {
+  struct editorBuffer *buf;
+  int cap, cur;
+};
+
+struct editorBuffers buffers;
+
+void editorBufferStash(struct editorBuffer *b) {
+  b->cx = E.cx;
+  b->cy = E.cy;
+  b->rowoff = E.rowoff;
+  b->coloff = E.coloff;
+  b->wrap = E.wrap;
+  b->wrapoff = E.wrapoff;
+  b->wrapcols = E.screencols;
+  b->numrows = E.numrows;
+  b->rows = E.rows;
+  b->map = E.map;
+  b->maplen = E.maplen;
+  b->dirty = E.dirty;
+  b->readonly = E.readonly;
+  b->filename = E.filename;
+  b->syntax = E.syntax;
+  b->hl_valid = E.hl_valid;
+  b->undo = undo;
+  b->pager = pager;
+  b->journal = journal;
+}
+
+void editorBufferRestore(struct editorBuffer *b) {
+  E.cx = b->cx;
+  E.cy = b->cy;
+  E.rowoff = b->rowoff;
+  E.coloff = b->coloff;
+  E.wrap = b->wrap;
+  E.wrapoff = b->wrapoff;
+  E.numrows = b->numrows;
+  E.rows = b->rows;
+  E.map = b->map;
+  E.maplen = b->maplen;
+  E.dirty = b->dirty;
+  E.readonly = b->readonly;
+  E.filename = b->filename;
+  E.syntax = b->syntax;
+  E.hl_valid = b->hl_valid;
+  undo = b->undo;
+  pager = b->pager;
+  journal = b->journal;
+  // The window was resized while we were away
+  if (b->wrapcols != E.screencols)
+    editorWrapInvalidate();
+  E.frame_valid = 0;
+}
+
+// What runs in the background works on the file in E, so it has to be done
+// before another file takes its place. Following stops for good. Nothing
+// keeps time for the swap file of a file in the background, so it's synced
+// now rather than when due.
+void editorBufferLeave() {
+  editorSaveFinish(1);
+  journalFlush();
+  if (journal.fd != -1)
+    journalSync();
+  editorFollowStop();
+  editorSyntaxStop();
+}
+
+void editorBufferSwitch(int to) {
+  if (to == buffers.cur)
+    return;
+  editorBufferLeave();
+  editorBufferStash(&buffers.buf[buffers.cur]);
+  buffers.cur = to;
+  editorBufferRestore(&buffers.buf[to]);
+}
+
+// Opens `filename` next to the files already open, or goes to it if it's
+// one of them. An empty [No Name] buffer is reused.
+void editorBufferOpen(char *filename) {
+  for (int i = 0; i < E.nbuffers; i++) {
+    char *name = i == buffers.cur ? E.filename : buffers.buf[i].filename;
+    if (name && strcmp(name, filename) == 0) {
+      editorBufferSwitch(i);
+      return;
+    }
+  }
+  if (access(filename, R_OK) != 0) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
+  if (E.filename == NULL && E.numrows == 0 && !E.dirty) {
+    editorOpen(filename);
+    return;
+  }
+
+  if (E.nbuffers + 1 > buffers.cap) {
+    buffers.cap = buffers.cap ? buffers.cap * 2 : 8;
+    buffers.buf = realloc(buffers.buf, sizeof(*buffers.buf) * buffers.cap);
+    if (buffers.buf == NULL)
+      die("realloc");
+  }
+  editorBufferLeave();
+  editorBufferStash(&buffers.buf[buffers.cur]);
+  buffers.cur = E.nbuffers++;
+
+  // A file of its own, wrapping and -r carry over from the one before
+  E.rows = (rownode *)rowtreeNewLeaf();
+  E.numrows = 0;
+  E.map = NULL;
+  E.maplen = 0;
+  E.filename = NULL;
+  memset(&undo, 0, sizeof(undo));
+  memset(&pager, 0, sizeof(pager));
+  journal = (struct editorJournal){.fd = -1};
+  E.frame_valid = 0;
+  editorOpen(filename);
+}
+
+// How many open files have unsaved changes
+int editorBuffersDirty() {
+  int n = E.dirty != 0;
+  for (int i = 0; i < E.nbuffers; i++)
+    if (i != buffers.cur)
+      n += buffers.buf[i].dirty != 0;
+  return n;
+}
+
+// Quitting without saving means the swap files aren't wanted either
+void editorBuffersDiscard() {
+  journalClose(&journal, 0);
+  for (int i = 0; i < E.nbuffers; i++)
+    if (i != buffers.cur)
+      journalClose(&buffers.buf[i].journal, 0);
+}
+
+void editorBufferPrompt() {
+  char *filename = editorPrompt("Open: %s (ESC to cancel)", NULL, 0);
+  if (filename == NULL)
+    return;
+  editorBufferOpen(filename);
+  free(filename);
+}
+
+/* Event loop */
+
+// How often to check on the file we follow if the kernel won't tell us
+#define FOLLOW_POLL_MS 250
+
+long long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// How long we can sleep for before something needs doing even without any
+// input, -1 if nothing does
+int editorIdleTimeout() {
+  int timeout = -1;
+  // The status message has to be taken down once it's been up long enough
+  if (E.statusmsg[0]) {
+    long long left =
+        (long long)(E.statusmsg_time + KILO_STATUS_TIMEOUT) * 1000 -
+        editorNowMs();
+    if (left > 0)
+      timeout = left;
+  }
+  if (follow.fd != -1 && (follow.inotify == -1 || follow.pending))
+    if (timeout == -1 || timeout > FOLLOW_POLL_MS)
+      timeout = FOLLOW_POLL_MS;
+  // So is syncing the swap file
+  if (journal.unsynced) {
+    long long left = journal.syncdue - editorNowMs();
+    if (left < 0)
+      left = 0;
+    if (timeout == -1 || timeout > left)
+      timeout = left;
+  }
+  return timeout;
+}
+
+// Sleeps until there is input from the terminal, for at most `timeout` ms.
+// With `others` set, background work calling editorWakeup and changes to the
+// file we follow wake us up as well. Returns whether there is input.
+int editorWait(int timeout, int others) {
+  struct pollfd fds[3];
+  int n = 0;
+  fds[n].fd = STDIN_FILENO;
+  fds[n++].events = POLLIN;
+  if (others) {
+    fds[n].fd = pool.wakepipe[0];
+    fds[n++].events = POLLIN;
+    if (follow.inotify != -1) {
+      fds[n].fd = follow.inotify;
+      fds[n++].events = POLLIN;
+    }
+  }
+
+  if (poll(fds, n, timeout) == -1) {
+    if (errno == EINTR)
+      return 0;
+    die("poll");
+  }
+  return fds[0].revents != 0;
+}
+
+// SIGWINCH only sets this and pokes the event loop, which then goes and gets
+// the new size of the window itself
+volatile sig_atomic_t resized = 0;
+
+void editorHandleWinch(int sig) {
+  (void)sig;
+  int saved = errno;
+  resized = 1;
+  write(pool.wakepipe[1], "", 1);
+  errno = saved;
+}
+
+void editorInitSignals() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleWinch;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+void editorCheckResize() {
+  if (!resized)
+    return;
+  resized = 0;
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == 0)
+    editorSetScreenSize(rows, cols);
+}
+
+// Rows read the file through the mapping, so when something else truncates
+// it, touching a line that got cut off raises SIGBUS. Rather than crash we put
+// zeroed memory in place of the mapping from that page on, where those lines
+// then read as NULs, and set this to say so. Other files that are open get the
+// same treatment.
+volatile sig_atomic_t maplost = 0;
+long mappage;
+
+void editorHandleBus(int sig, siginfo_t *info, void *ctx) {
+  (void)ctx;
+  char *addr = info->si_addr;
+  // E has the file being edited, what `buffers` holds for it is stale
+  for (int i = -1; i < E.nbuffers; i++) {
+    if (i == buffers.cur)
+      continue;
+    char *map = i < 0 ? E.map : buffers.buf[i].map;
+    size_t len = i < 0 ? E.maplen : buffers.buf[i].maplen;
+    if (map == NULL || addr < map || addr >= map + len)
+      continue;
+    char *page = map + ((addr - map) & ~(mappage - 1));
+    if (mmap(page, map + len - page, PROT_READ,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      break;
+    maplost = 1;
+    return;
   }
+  // Not ours, so the access gets made again and this time is fatal
+  signal(sig, SIG_DFL);
+}
+
+void editorGuardMap() {
+  mappage = sysconf(_SC_PAGESIZE);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = editorHandleBus;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  if (sigaction(SIGBUS, &sa, NULL) == -1)
+    die("sigaction");
+}
+
+// Tells the user once the file turned out to be shorter than its rows
+int editorCheckMap() {
+  if (!maplost)
+    return 0;
+  maplost = 0;
+  editorSetStatusMessage("%s got truncated, lines cut off show up as NULs",
+                         E.filename ? E.filename : "The file");
+  return 1;
 }
 
 /* Append buffer */
 
+// The buffer only ever grows, and by doubling, so that one kept around
+// between refreshes stops reallocating once it has seen the largest frame.
 struct abuf {
   char *b;
   int len;
+  int cap;
+  // Number of times we had to grow the buffer
+  int allocs;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0, 0}
+
+// Makes room for `len` more bytes and returns where they should go. The
+// caller is expected to fill all of them.
+char *abReserve(struct abuf *ab, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL)
+      return NULL;
+    ab->b = new;
+    ab->cap = cap;
+    ab->allocs++;
+  }
+  char *p = &ab->b[ab->len];
+  ab->len += len;
+  return p;
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+  char *p = abReserve(ab, len);
 
-  if (new == NULL)
+  if (p == NULL)
     return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  memcpy(p, s, len);
+}
+
+// Empties the buffer but holds on to its memory for the next user
+void abReset(struct abuf *ab) {
+  ab->len = 0;
+  ab->allocs = 0;
+}
+
+void abFree(struct abuf *ab) { free(ab->b); }
+
+/* Instrumentation */
+
+long long editorNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called for every key read, the first one since the last frame starts the
+// clock on how long it takes to show
+void editorStatKey() {
+  if (stats.keyns == 0)
+    stats.keyns = editorNowNs();
+}
+
+void editorTraceFinish() {
+  if (stats.trace == NULL)
+    return;
+  fprintf(stats.trace, "\n]}\n");
+  fclose(stats.trace);
+  stats.trace = NULL;
+}
+
+void editorTraceStart() {
+  char *path = getenv("KILO_TRACE");
+  if (path == NULL || path[0] == '\0')
+    return;
+  stats.trace = fopen(path, "w");
+  if (stats.trace == NULL)
+    die("KILO_TRACE");
+  fprintf(stats.trace, "{\"traceEvents\":[");
+  atexit(editorTraceFinish);
+}
+
+// A span of time from `from` to `to`, in ns
+void editorTraceSpan(const char *name, long long from, long long to) {
+  fprintf(stats.trace,
+          "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+          "\"ts\":%.3f,\"dur\":%.3f}",
+          stats.traced++ ? "," : "", name, from / 1000.0, (to - from) / 1000.0);
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+// Takes down the timings of a frame that started at `start`, was drawn into
+// `ab` by `drawn` and written out by `written`
+void editorStatFrame(long long start, long long drawn, long long written,
+                     struct abuf *ab) {
+  stats.scrollns = stats.scrolled - start;
+  stats.drawns = drawn - stats.scrolled;
+  stats.writens = written - drawn;
+  stats.bytes = ab->len;
+  stats.growths = ab->allocs;
+  stats.allocs = E.arena.allocs - stats.arenaseen;
+  stats.arenaseen = E.arena.allocs;
+
+  if (stats.trace) {
+    if (stats.keyns)
+      editorTraceSpan("key to frame", stats.keyns, written);
+    editorTraceSpan("scroll", start, stats.scrolled);
+    editorTraceSpan("draw", stats.scrolled, drawn);
+    editorTraceSpan("write", drawn, written);
+    fprintf(stats.trace,
+            ",\n{\"name\":\"frame\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+            "\"args\":{\"bytes\":%d,\"growths\":%d,\"allocs\":%lld}}",
+            start / 1000.0, stats.bytes, stats.growths, stats.allocs);
+  }
+  if (stats.keyns) {
+    stats.latencyns = written - stats.keyns;
+    stats.keyns = 0;
+  }
+}
 
 /* Output */
 
+// The first line on screen, counting screen lines from the top of the file
+int editorTopLine() {
+  return E.wrap ? rowtreeLineOf(E.rowoff) + E.wrapoff : E.rowoff;
+}
+
+// Which of its row's screen lines the cursor is on when wrapping, and at
+// what column `*x`
+int editorCursorSegment(int *x) {
+  *x = 0;
+  erow *row = editorRowAt(E.cy);
+  if (row == NULL)
+    return 0;
+  if (row->render == NULL)
+    editorUpdateRow(row);
+  return editorRowLineOf(row, E.rx, x);
+}
+
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+  }
+
+  // With wrapping the same goes for screen lines, which then get turned back
+  // into the row at the top and how many of its lines are above the screen
+  if (E.wrap) {
+    editorWrapView();
+    int x;
+    int line = rowtreeLineOf(E.cy) + editorCursorSegment(&x);
+    int top = editorTopLine();
+    if (line < top)
+      top = line;
+    if (line >= top + E.screenrows)
+      top = line - E.screenrows + 1;
+    E.wrapoff = top;
+    E.rowoff = rowtreeRowAtLine(&E.wrapoff);
+    E.coloff = 0;
+    return;
   }
 
   // If the cursor is above the visible window, set the offset to where the
@@ -674,11 +5666,221 @@ void editorScroll() {
   }
 }
 
-// Should be called with the cursor at the top right
+// Makes sure the copy of what's on the terminal matches the window's size. A
+// fresh copy doesn't know what the terminal shows, so it gets cleared on the
+// next refresh.
+void editorFrameResize() {
+  int rows = E.screenrows + 2;
+  int cols = E.screencols;
+  if (E.frame && E.framerows == rows && E.framecols == cols)
+    return;
+
+  screencell *frame = malloc(sizeof(screencell) * rows * cols);
+  if (frame == NULL)
+    die("malloc");
+  // Terminals differ in what they do with the screen when it gets resized:
+  // some keep it anchored to the top, some to the bottom, many rewrap lines
+  // when the width changes. None of the old grid can be trusted after that.
+  E.frame_valid = 0;
+  free(E.frame);
+  E.frame = frame;
+  E.framerows = rows;
+  E.framecols = cols;
+}
+
+int editorCellsEqual(screencell *a, screencell *b) {
+  return memcmp(a->c, b->c, sizeof(a->c)) == 0 && a->attr == b->attr;
+}
+
+void editorSetAttr(struct abuf *ab, unsigned char attr) {
+  if (attr == E.termattr)
+    return;
+  E.termattr = attr;
+
+  // Start from a clean slate (0) and add reverse video (7) and a colour on
+  // top of that as needed
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[0%s",
+                     attr & CELL_INVERSE ? ";7" : "");
+  if ((attr & ~CELL_INVERSE) != HL_NORMAL)
+    len += snprintf(&buf[len], sizeof(buf) - len, ";%d",
+                    editorSyntaxToColor(attr & ~CELL_INVERSE));
+  buf[len++] = 'm';
+  abAppend(ab, buf, len);
+}
+
+// Fills `line` with the `len` bytes of `s` starting at column `*x`. ASCII
+// goes a byte to a cell, anything else a char (see utf8Grapheme) at a time.
+void editorPutCells(screencell *line, int *x, const char *s,
+                    const unsigned char *hl, int len, unsigned char attr) {
+  for (int j = 0; j < len && *x < E.screencols;) {
+    unsigned char a = hl ? hl[j] : attr;
+    if (!(s[j] & 0x80) && (j + 1 == len || !(s[j + 1] & 0x80))) {
+      line[(*x)++] = (screencell){{s[j]}, a};
+      j++;
+      continue;
+    }
+
+    int width, end = j + utf8Grapheme(&s[j], len - j, &width);
+    // Wide chars that don't fit at the edge are left off
+    if (*x + width > E.screencols)
+      break;
+    screencell *cell = &line[(*x)++];
+    *cell = (screencell){{0}, a};
+    int n = 0, cp;
+    for (int k = j; k < end;) {
+      int m = utf8Decode(&s[k], end - k, &cp);
+      if (m == 0) {
+        cell->c[n++] = '?';
+        k++;
+        continue;
+      }
+      // Marks with nothing to go on go on a space. Codepoints that don't fit
+      // in the cell are dropped.
+      if (n == 0 && utf8Width(cp) == 0)
+        cell->c[n++] = ' ';
+      if (n + m > (int)sizeof(cell->c))
+        break;
+      memcpy(&cell->c[n], &s[k], m);
+      n += m;
+      k += m;
+    }
+    if (width == 2)
+      line[(*x)++] = (screencell){{0}, a};
+    j = end;
+  }
+}
+
+// Compares screen line `y` against what we drew there last time and emits
+// just the span that changed
+void editorFlushLine(struct abuf *ab, int y, screencell *line) {
+  screencell *old = &E.frame[y * E.framecols];
+
+  int first = 0;
+  while (first < E.screencols && editorCellsEqual(&old[first], &line[first]))
+    first++;
+  if (first == E.screencols)
+    return;
+  // Start from the left half when only the right half of a wide char changed
+  if (first > 0 && line[first].c[0] == '\0')
+    first--;
+
+  int last = E.screencols - 1;
+  while (last > first && editorCellsEqual(&old[last], &line[last]))
+    last--;
+
+  // If the rest of the line is blank we can clear it with a single K (erase
+  // in line) rather than printing spaces over it
+  int end = E.screencols;
+  while (end > first && editorCellsEqual(&line[end - 1], &CELL_BLANK))
+    end--;
+  int erase = last >= end;
+  if (erase)
+    last = end - 1;
+
+  // The `H` command repositions the cursor and is 1-indexed
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+  abAppend(ab, buf, len);
+
+  // Copy runs of cells sharing the same attributes in one go
+  int x = first;
+  while (x <= last) {
+    int run = x + 1;
+    while (run <= last && line[run].attr == line[x].attr)
+      run++;
+
+    editorSetAttr(ab, line[x].attr);
+    char *p = abReserve(ab, (run - x) * sizeof(line[x].c));
+    if (p == NULL)
+      return;
+    char *start = p;
+    int cells = run - x;
+    for (; x < run; x++) {
+      char *c = line[x].c;
+      if (c[1] == '\0') {
+        // The right half of a wide char is empty, it went out with the left
+        if (c[0])
+          *p++ = c[0];
+        continue;
+      }
+      for (int k = 0; k < (int)sizeof(line[x].c) && c[k]; k++)
+        *p++ = c[k];
+    }
+    // Give back what wasn't needed, most cells only take a byte
+    ab->len -= cells * sizeof(line[0].c) - (p - start);
+  }
+  if (erase) {
+    // Erasing fills with the current background, so go back to normal first
+    editorSetAttr(ab, HL_NORMAL);
+    abAppend(ab, "\x1b[K", 3);
+  }
+
+  memcpy(old, line, sizeof(screencell) * E.screencols);
+}
+
+// When the view moved by a few rows, shift what's already on the terminal
+// with S (scroll up) or T (scroll down) inside a scroll region covering the
+// text area, so only the rows that came into view need to be drawn.
+void editorScrollFrame(struct abuf *ab) {
+  int top = editorTopLine();
+  int shift = top - E.frame_rowoff;
+  E.frame_rowoff = top;
+  if (shift == 0 || !E.frame_valid)
+    return;
+  if (abs(shift) > E.screenrows / 2)
+    return;
+
+  char buf[32];
+  editorSetAttr(ab, HL_NORMAL);
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c", E.screenrows,
+                     abs(shift), shift > 0 ? 'S' : 'T');
+  abAppend(ab, buf, len);
+  // Reset the scroll region to the whole window
+  abAppend(ab, "\x1b[r", 3);
+
+  int keep = E.screenrows - abs(shift);
+  screencell *text = E.frame;
+  screencell *vacated;
+  if (shift > 0) {
+    memmove(text, &text[shift * E.framecols],
+            sizeof(screencell) * keep * E.framecols);
+    vacated = &text[keep * E.framecols];
+  } else {
+    memmove(&text[-shift * E.framecols], text,
+            sizeof(screencell) * keep * E.framecols);
+    vacated = text;
+  }
+  for (int j = 0; j < abs(shift) * E.framecols; j++)
+    vacated[j] = CELL_BLANK;
+}
+
+void editorBlankLine(screencell *line) {
+  for (int x = 0; x < E.screencols; x++)
+    line[x] = CELL_BLANK;
+}
+
 void editorDrawRows(struct abuf *ab) {
+  screencell line[E.screencols];
+
+  // Rows on screen get highlighted right away if we know what state the
+  // first of them starts in. If not they're drawn plain until the background
+  // job gets that far.
+  editorSyntaxCollect();
+  if (E.hl_valid >= E.rowoff)
+    editorSyntaxUpTo(E.rowoff + E.screenrows);
+  editorSyntaxStart(E.hl_valid < E.rowoff ? E.rowoff : -1);
+
+  // Which row goes on the next screen line, and which of its lines that is
+  // when wrapping
+  int filerow = E.rowoff;
+  int seg = E.wrap ? E.wrapoff : 0;
+
   // Drawing tildes on rows that aren't part of the file being edited
   for (int y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
+    int x = 0;
+    editorBlankLine(line);
+
     if (filerow >= E.numrows) {
       // Only print if user didn't open a file
       if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -694,135 +5896,205 @@ void editorDrawRows(struct abuf *ab) {
         int padding = (E.screencols - len) / 2;
 
         if (padding) {
-          abAppend(ab, "~", 1);
+          editorPutCells(line, &x, "~", NULL, 1, HL_NORMAL);
           padding--;
         }
-        while (padding--)
-          abAppend(ab, " ", 1);
+        x += padding;
 
-        abAppend(ab, welcome, len);
+        editorPutCells(line, &x, welcome, NULL, len, HL_NORMAL);
       } else {
-        abAppend(ab, "~", 1);
+        editorPutCells(line, &x, "~", NULL, 1, HL_NORMAL);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      erow *row = editorRowAt(filerow);
+      if (row->render == NULL)
+        editorUpdateRow(row);
+      unsigned char *hl = editorRowHighlight(row, filerow);
+
+      int pad = 0;
+      int from = E.wrap ? editorRowLineStart(row, seg)
+                        : editorRowRenderAt(row, E.coloff, &pad);
+      int len = row->rsize - from;
+      x += pad;
       // In case the user scrolled off the end of the line
-      if (len < 0)
-        len = 0;
-      else if (len > E.screencols)
-        len = E.screencols;
-
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      // Keep track of current color so we don't unnecessarily print the code
-      // to switch colors
-      int current_color = -1;
-
-      for (int j = 0; j < len; j++) {
-        if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (current_color != color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
+      if (len > 0)
+        editorPutCells(line, &x, &row->render[from], hl ? &hl[from] : NULL,
+                       len, HL_NORMAL);
+      if (E.wrap && ++seg < row->height) {
+        editorFlushLine(ab, y, line);
+        continue;
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
 
-    // K (erase in line) with the default argument 0, erases the part of the
-    // line to the right of the cursor.
-    abAppend(ab, "\x1b[K", 3);
-
-    abAppend(ab, "\r\n", 2);
+    editorFlushLine(ab, y, line);
+    filerow++;
+    seg = 0;
   }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-  // Use inverted colour formatting
-  abAppend(ab, "\x1b[7m", 4);
-
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     E.filename ? E.filename : "[No Name]", E.numrows,
-                     E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy, E.numrows - 1);
-  if (len > E.screencols) {
-    len = E.screencols;
-  }
-  abAppend(ab, status, len);
-
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    }
-
-    // Padding between left and right
-    abAppend(ab, " ", 1);
-    len++;
+  screencell line[E.screencols];
+  int x = 0;
+
+  // The pager only knows how many lines there are once it counted them all
+  char status[80], rstatus[80], cur[24], total[24], last[24];
+  long long lines = E.numrows;
+  snprintf(cur, sizeof(cur), "%d", E.cy);
+  if (pager.on) {
+    pagerDescribe(cur, sizeof(cur), E.cy);
+    lines = pager.indexed == E.maplen ? pager.lines : -1;
+  }
+  snprintf(total, sizeof(total), lines < 0 ? "?" : "%lld", lines);
+  snprintf(last, sizeof(last), lines < 0 ? "?" : "%lld", lines - 1);
+  char which[32] = "";
+  if (E.nbuffers > 1)
+    snprintf(which, sizeof(which), "[%d/%d] ", buffers.cur + 1, E.nbuffers);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %s lines %s", which,
+                     E.filename ? E.filename : "[No Name]", total,
+                     E.readonly ? "(read-only)"
+                     : E.dirty  ? "(modified)"
+                                : "");
+  if (savejob.running) {
+    pthread_mutex_lock(&savejob.lock);
+    int percent = savejob.total ? savejob.written * 100 / savejob.total : 0;
+    pthread_mutex_unlock(&savejob.lock);
+    len += snprintf(&status[len], sizeof(status) - len, " (saving %d%%)",
+                    percent);
+    if (len >= (int)sizeof(status))
+      len = sizeof(status) - 1;
+  }
+  int rlen = 0;
+  if (stats.overlay) {
+    // The previous frame: ms spent scrolling, drawing and writing it, ms from
+    // the last key to its frame, bytes written, times the output buffer grew
+    // and arena allocations
+    rlen = snprintf(rstatus, sizeof(rstatus),
+                    "%.2f/%.2f/%.2f %.1fms %dB %dg %llda | ",
+                    stats.scrollns / 1e6, stats.drawns / 1e6,
+                    stats.writens / 1e6, stats.latencyns / 1e6, stats.bytes,
+                    stats.growths, stats.allocs);
+  }
+  rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %s/%s",
+                   E.syntax ? E.syntax->filetype : "no ft", cur, last);
+  if (rlen >= (int)sizeof(rstatus))
+    rlen = sizeof(rstatus) - 1;
+
+  // Use inverted colour formatting, padding between left and right
+  for (int j = 0; j < E.screencols; j++)
+    line[j] = (screencell){" ", CELL_INVERSE};
+  editorPutCells(line, &x, status, NULL, len, CELL_INVERSE);
+  if (len + rlen <= E.screencols) {
+    x = E.screencols - rlen;
+    editorPutCells(line, &x, rstatus, NULL, rlen, CELL_INVERSE);
   }
 
-  // Switch back to normal formatting
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  editorFlushLine(ab, E.screenrows, line);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-  // Clear the message bar
-  abAppend(ab, "\x1b[K", 3);
+  screencell line[E.screencols];
+  int x = 0;
+  editorBlankLine(line);
 
   int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) {
-    msglen = E.screencols;
+  if (msglen && time(NULL) - E.statusmsg_time < KILO_STATUS_TIMEOUT)
+    editorPutCells(line, &x, E.statusmsg, NULL, msglen, HL_NORMAL);
+
+  // Keep a tally of the matches on the right while searching
+  if (search.query && (search.qlen || search.regex)) {
+    char info[48];
+    int len;
+    if (search.error)
+      len = snprintf(info, sizeof(info), "[regex] %s", search.error);
+    else if (search.qlen == 0)
+      len = snprintf(info, sizeof(info), "[regex]");
+    else if (search.found.numhits == 0 && !search.scanning)
+      len = snprintf(info, sizeof(info), "%sNo matches",
+                     search.regex ? "[regex] " : "");
+    else
+      len = snprintf(info, sizeof(info), "%s%d match%s%s",
+                     search.regex ? "[regex] " : "", search.found.numhits,
+                     search.found.numhits == 1 ? "" : "es",
+                     search.scanning ? " (scanning...)" : "");
+    if (x + len + 1 <= E.screencols) {
+      x = E.screencols - len;
+      editorPutCells(line, &x, info, NULL, len, HL_NORMAL);
+    }
   }
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+
+  editorFlushLine(ab, E.screenrows + 1, line);
 }
 
 // Escape sequences: https://vt100.net/docs/vt100-ug/chapter3.html
 // \x1b - escape
 // J    - erase in display
 // 2    - clear entire screen (other options are 0 and 1, check docs)
-void editorRefreshScreen() {
+//
+// We keep a copy of what the terminal shows and only send the cells that
+// differ from it, so a keystroke usually costs a few bytes rather than a
+// whole screen.
+// Puts what it takes to bring the terminal up to date into `ab`
+void editorDrawFrame(struct abuf *ab) {
   editorScroll();
-
-  struct abuf ab = ABUF_INIT;
+  stats.scrolled = editorNowNs();
+  editorFrameResize();
+  abReset(ab);
 
   // Use the l command (reset mode) with argument `?25` to hide the cursor
   // while we redraw the screen.
-  abAppend(&ab, "\x1b[?25l", 6);
-
-  // The `H` command repositions the cursor, its default args place the cursor
-  // at the top left, exactly where we want it.
-  abAppend(&ab, "\x1b[H", 3);
+  abAppend(ab, "\x1b[?25l", 6);
+
+  if (!E.frame_valid) {
+    // Start from a blank terminal that we know the contents of
+    abAppend(ab, "\x1b[m\x1b[2J", 7);
+    E.termattr = HL_NORMAL;
+    for (int j = 0; j < E.framerows * E.framecols; j++)
+      E.frame[j] = CELL_BLANK;
+    E.frame_rowoff = editorTopLine();
+    E.frame_valid = 1;
+  }
+  editorScrollFrame(ab);
 
   // Draw rows and status bar
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorDrawRows(ab);
+  editorDrawStatusBar(ab);
+  editorDrawMessageBar(ab);
 
   // Reposition cursor
+  int y = E.cy - E.rowoff;
+  int x = E.rx - E.coloff;
+  if (E.wrap) {
+    y = rowtreeLineOf(E.cy) + editorCursorSegment(&x) - editorTopLine();
+    if (x >= E.screencols)
+      x = E.screencols - 1;
+  }
   char buf[32];
   // The `H` command repositions the cursor and 1-indexed
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1,
-           E.rx - E.coloff + 1);
-  abAppend(&ab, buf, strlen(buf));
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, strlen(buf));
 
   // Use the h command (set mode) to restore the cursor
-  abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(ab, "\x1b[?25h", 6);
+}
+
+void editorRefreshScreen() {
+  editorSaveFinish(0);
+
+  // Reused across refreshes, so after the first few frames drawing doesn't
+  // allocate at all
+  static struct abuf ab = ABUF_INIT;
+  long long start = editorNowNs();
+  editorDrawFrame(&ab);
+  // Drawing is what's most likely to run into lines cut off the file. The
+  // frame we have would never get written, so the next one starts afresh.
+  if (editorCheckMap()) {
+    E.frame_valid = 0;
+    editorDrawFrame(&ab);
+  }
+  long long drawn = editorNowNs();
 
   write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  editorStatFrame(start, drawn, editorNowNs(), &ab);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -837,7 +6109,9 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /* Input */
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Asks for a line of input in the message bar, NULL if the user gave up. An
+// empty answer is only taken if `empty` is set.
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
 
@@ -851,8 +6125,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     int c = editorReadKey();
 
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      if (buflen != 0)
-        buf[--buflen] = '\0';
+      // Back over a whole UTF-8 sequence
+      while (buflen != 0 && (buf[--buflen] & 0xc0) == 0x80)
+        ;
+      buf[buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback) {
@@ -861,19 +6137,26 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       free(buf);
       return NULL;
     } else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || empty) {
         editorSetStatusMessage("");
         if (callback) {
           callback(buf, c);
         }
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
-      if (buflen == bufsize - 1) {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
+    } else if (c == PASTE || (c < 256 && !iscntrl(c))) {
+      // Pastes go in whole, minus whatever can't be shown
+      int n = c == PASTE ? input.pastelen : 1;
+      for (int j = 0; j < n; j++) {
+        unsigned char ch = c == PASTE ? input.paste[j] : c;
+        if (iscntrl(ch))
+          continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = ch;
       }
-      buf[buflen++] = c;
       buf[buflen] = '\0';
     }
 
@@ -885,22 +6168,22 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
 void editorMoveCursor(int key) {
   // Row where the cursor currently is
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRowAt(E.cy);
 
   switch (key) {
   case ARROW_LEFT:
     if (E.cx != 0) {
-      E.cx--;
+      E.cx = editorRowPrevChar(row, E.cx);
     } else if (E.cy > 0) {
       // If the user is not on the first line and is at the far left of a line,
       // allow the user to go up to the previous line
       E.cy--;
-      E.cx = E.row[E.cy].size;
+      E.cx = editorRowAt(E.cy)->size;
     }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size) {
-      E.cx++;
+      E.cx = editorRowNextChar(row, E.cx);
     } else if (row && E.cx == row->size) {
       // Allow the user to run off the end of a line to the next line if he
       // isn't already on the last row
@@ -920,13 +6203,58 @@ void editorMoveCursor(int key) {
   }
 
   // Get new row as we may have moved
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   // If we moved from a longer line to a shorter line, ensure that the current
   // `cx` does not exceed the length of the current line
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // Nor land in the middle of a char
+  if (row)
+    E.cx = editorRowCharStart(row, E.cx);
+}
+
+// Moves the cursor as if put at the top or bottom of the screen and then
+// moved up or down a whole screen from there. With wrapping that's in screen
+// lines, keeping to the same column on screen.
+void editorMovePage(int key) {
+  // Keys that came in together are handled before the next refresh, so the
+  // offsets may not have caught up with the cursor yet
+  editorScroll();
+  if (!E.wrap) {
+    E.cy = key == PAGE_UP ? E.rowoff - E.screenrows
+                          : E.rowoff + 2 * E.screenrows - 1;
+  } else {
+    int x;
+    editorCursorSegment(&x);
+    int top = editorTopLine();
+    int line = key == PAGE_UP ? top - E.screenrows : top + 2 * E.screenrows - 1;
+    int lines = rowtreeLines(E.rows);
+    line = line < 0 ? 0 : line > lines ? lines : line;
+    E.cy = rowtreeRowAtLine(&line);
+    erow *row = editorRowAt(E.cy);
+    if (row) {
+      // Same column on screen, laid out the way the line is drawn. A line
+      // that ends early at a wide char leaves the cursor on its last char.
+      if (row->render == NULL)
+        editorUpdateRow(row);
+      int rx = editorRowLineCol(row, line) + x;
+      int next = editorRowLineCol(row, line + 1);
+      if (rx >= next && next < editorRowWidth(row))
+        rx = next - 1;
+      E.cx = editorRowRxToCx(row, rx);
+    }
+  }
+
+  if (E.cy < 0)
+    E.cy = 0;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  erow *row = editorRowAt(E.cy);
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen)
+    E.cx = rowlen;
 }
 
 void editorProcessKeypress() {
@@ -934,6 +6262,22 @@ void editorProcessKeypress() {
   static int quit_times = KILO_QUIT_TIMES;
 
   int c = editorReadKey();
+  if (c == NO_KEY)
+    return;
+
+  // Edits from one key are undone together, and a run of typing or deleting
+  // in one place is undone as one
+  undo.group++;
+  int typing =
+      IS_TEXT_KEY(c) || c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY;
+  if (!typing)
+    editorUndoBreak();
+  if (E.readonly && (typing || c == '\r' || c == PASTE || c == CTRL_KEY('s') ||
+                     c == CTRL_KEY('r') || c == CTRL_KEY('z') ||
+                     c == CTRL_KEY('y'))) {
+    editorSetStatusMessage("Read-only, opened with -r");
+    return;
+  }
 
   switch (c) {
   case '\r': {
@@ -942,13 +6286,24 @@ void editorProcessKeypress() {
   }
 
   case CTRL_KEY('q'): {
-    if (E.dirty && quit_times > 0) {
+    // Let a save that's under way finish first
+    editorSaveFinish(1);
+    int dirty = editorBuffersDirty();
+    if (dirty > 1 && quit_times > 0) {
+      editorSetStatusMessage("WARNING!!! %d files have unsaved changes. "
+                             "Press Ctrl-Q %d more times to quit.",
+                             dirty, quit_times);
+      quit_times--;
+      return;
+    }
+    if (dirty && quit_times > 0) {
       editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                              "Press Ctrl-Q %d more times to quit.",
                              quit_times);
       quit_times--;
       return;
     }
+    editorBuffersDiscard();
     // Refer to editorRefreshScreen for what these do
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
@@ -968,7 +6323,7 @@ void editorProcessKeypress() {
 
   case END_KEY:
     if (E.cy < E.numrows)
-      E.cx = E.row[E.cy].size;
+      E.cx = editorRowAt(E.cy)->size;
     break;
 
   case CTRL_KEY('f'): {
@@ -976,6 +6331,44 @@ void editorProcessKeypress() {
     break;
   }
 
+  case CTRL_KEY('r'):
+    editorReplace();
+    break;
+
+  case CTRL_KEY('g'):
+    editorGoto();
+    break;
+
+  case CTRL_KEY('o'):
+    editorBufferPrompt();
+    break;
+
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'): {
+    int step = c == CTRL_KEY('n') ? 1 : E.nbuffers - 1;
+    editorBufferSwitch((buffers.cur + step) % E.nbuffers);
+    break;
+  }
+
+  case CTRL_KEY('z'):
+    editorUndo();
+    break;
+
+  case CTRL_KEY('y'):
+    editorRedo();
+    break;
+
+  case CTRL_KEY('t'):
+    stats.overlay = !stats.overlay;
+    break;
+
+  case CTRL_KEY('w'):
+    E.wrap = !E.wrap;
+    E.coloff = E.wrapoff = 0;
+    editorWrapInvalidate();
+    editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+    break;
+
   case BACKSPACE:
   case CTRL_KEY('h'):
   case DEL_KEY: {
@@ -988,23 +6381,9 @@ void editorProcessKeypress() {
   }
 
   case PAGE_UP:
-  case PAGE_DOWN: {
-    // Put the cursor at the very top or bottom of the screen
-    if (c == PAGE_UP) {
-      E.cy = E.rowoff;
-    } else if (c == PAGE_DOWN) {
-      E.cy = E.rowoff + E.screenrows - 1;
-      if (E.cy > E.numrows) {
-        E.cy = E.numrows;
-      }
-    }
-    // And move up/down an entire screen
-    int times = E.screenrows;
-    while (times--) {
-      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-    }
+  case PAGE_DOWN:
+    editorMovePage(c);
     break;
-  }
 
   case ARROW_UP:
   case ARROW_DOWN:
@@ -1018,42 +6397,699 @@ void editorProcessKeypress() {
   case '\x1b':        // Ignore the escape key too
     break;
 
+  case PASTE:
+    editorInsertText(input.paste, input.pastelen);
+    break;
+
   default: {
-    editorInsertChar(c);
+    // Typing fast (or pasting without brackets) tends to leave a run of plain
+    // chars in the input buffer, these all go in at once
+    if (IS_TEXT_KEY(c)) {
+      char run[INPUT_BUF_SIZE];
+      run[0] = c;
+      int n = 1 + editorTakeText(&run[1], sizeof(run) - 1);
+      editorInsertString(run, n);
+    } else {
+      editorInsertChar(c);
+    }
     break;
   }
   }
 
+  pagerSlide();
   quit_times = KILO_QUIT_TIMES;
 }
 
+/* Batch mode */
+
+// `kilo -s script file...` runs a script over each file and saves it if
+// anything changed, with no terminal involved. Each line of the script is one
+// of these (blank lines and ones starting with # are skipped):
+//
+//   goto LINE [COL]    Move the cursor, counting from 1
+//   insert TEXT        Insert TEXT at the cursor and move past it
+//   delete N           Delete N chars from the cursor on, newlines included
+//   find TEXT          Move the cursor to the next match, failing if none
+//   replace /OLD/NEW/  Replace every match of OLD (neither can have a
+//                      newline), any char can stand in for the /
+//
+// TEXT, OLD and NEW take \n, \t and \\ escapes, and a \ before the delimiter.
+enum scriptOpType {
+  SCRIPT_GOTO,
+  SCRIPT_INSERT,
+  SCRIPT_DELETE,
+  SCRIPT_FIND,
+  SCRIPT_REPLACE,
+};
+
+typedef struct scriptop {
+  int type;
+  // Line in the script, for error messages
+  int lineno;
+  // Line and column of a goto, count of a delete
+  int line, col;
+  char *text;
+  int len;
+  // What a replace puts in place of `text`
+  char *with;
+  int withlen;
+} scriptop;
+
+struct editorScript {
+  char *name;
+  scriptop *ops;
+  int nops, opcap;
+};
+
+struct editorScript script;
+
+void scriptError(int lineno, const char *msg) {
+  fprintf(stderr, "%s:%d: %s\n", script.name, lineno, msg);
+  exit(2);
+}
+
+// Decodes the escapes in `s` up to the first unescaped `delim` (or the end
+// if that's NUL) into a new string. Sets `*end` to just past the delimiter,
+// or NULL if there wasn't one.
+char *scriptUnescape(char *s, char delim, int *len, char **end) {
+  char *out = malloc(strlen(s) + 1);
+  if (out == NULL)
+    die("malloc");
+  int n = 0;
+  *end = NULL;
+  while (*s) {
+    if (*s == delim) {
+      *end = s + 1;
+      break;
+    }
+    if (*s == '\\' && s[1]) {
+      s++;
+      out[n++] = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+    } else {
+      out[n++] = *s;
+    }
+    s++;
+  }
+  out[n] = '\0';
+  *len = n;
+  return out;
+}
+
+void scriptLoad(char *name) {
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL)
+    die(name);
+  script.name = name;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  int lineno = 0;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    lineno++;
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      line[--linelen] = '\0';
+    if (linelen == 0 || line[0] == '#')
+      continue;
+
+    if (script.nops == script.opcap) {
+      script.opcap = script.opcap ? script.opcap * 2 : 16;
+      script.ops = realloc(script.ops, sizeof(scriptop) * script.opcap);
+      if (script.ops == NULL)
+        die("realloc");
+    }
+    scriptop *op = &script.ops[script.nops++];
+    memset(op, 0, sizeof(*op));
+    op->lineno = lineno;
+
+    char *arg = strchr(line, ' ');
+    if (arg)
+      *arg++ = '\0';
+    char *end;
+    if (strcmp(line, "goto") == 0) {
+      op->type = SCRIPT_GOTO;
+      op->col = 1;
+      if (arg == NULL || sscanf(arg, "%d %d", &op->line, &op->col) < 1)
+        scriptError(lineno, "goto needs a line number");
+    } else if (strcmp(line, "insert") == 0 || strcmp(line, "find") == 0) {
+      op->type = line[0] == 'i' ? SCRIPT_INSERT : SCRIPT_FIND;
+      if (arg == NULL || arg[0] == '\0')
+        scriptError(lineno, "missing text");
+      op->text = scriptUnescape(arg, '\0', &op->len, &end);
+      if (op->type == SCRIPT_FIND && memchr(op->text, '\n', op->len))
+        scriptError(lineno, "can't find across lines");
+    } else if (strcmp(line, "delete") == 0) {
+      op->type = SCRIPT_DELETE;
+      if (arg == NULL || sscanf(arg, "%d", &op->line) != 1 || op->line < 0)
+        scriptError(lineno, "delete needs a count");
+    } else if (strcmp(line, "replace") == 0) {
+      op->type = SCRIPT_REPLACE;
+      if (arg == NULL || arg[0] == '\0' || arg[0] == '\\')
+        scriptError(lineno, "replace needs /OLD/NEW/");
+      char delim = arg[0];
+      op->text = scriptUnescape(arg + 1, delim, &op->len, &end);
+      if (end)
+        op->with = scriptUnescape(end, delim, &op->withlen, &end);
+      if (end == NULL || op->len == 0)
+        scriptError(lineno, "replace needs /OLD/NEW/");
+      if (memchr(op->text, '\n', op->len) ||
+          memchr(op->with, '\n', op->withlen))
+        scriptError(lineno, "can't replace across lines");
+    } else {
+      scriptError(lineno, "unknown command");
+    }
+  }
+  free(line);
+  fclose(fp);
+}
+
+// Moves the cursor to the first match of the query at or after it
+int scriptFind() {
+  rowiter it;
+  editorRowIterInit(&it, E.cy);
+  char *s;
+  int size, col = E.cx;
+  for (int at = E.cy; (s = editorRowIterText(&it, &size)) != NULL; at++) {
+    int len;
+    int match = findNext(s, size, col, &len);
+    if (match != -1) {
+      E.cy = at;
+      E.cx = match;
+      return 0;
+    }
+    col = 0;
+  }
+  return -1;
+}
+
+// Applies the script to one file and saves it, returns -1 if that failed
+int scriptRun(char *filename) {
+  editorOpen(filename);
+  for (int j = 0; j < script.nops; j++) {
+    scriptop *op = &script.ops[j];
+    erow *row;
+    switch (op->type) {
+    case SCRIPT_GOTO:
+      E.cy = op->line < 1 ? 0 : op->line > E.numrows ? E.numrows : op->line - 1;
+      row = editorRowAt(E.cy);
+      E.cx = op->col < 1 ? 0 : op->col - 1;
+      if (E.cx > (row ? row->size : 0))
+        E.cx = row ? row->size : 0;
+      break;
+    case SCRIPT_INSERT:
+      editorInsertText(op->text, op->len);
+      break;
+    case SCRIPT_DELETE:
+      editorDelForward(op->line);
+      break;
+    case SCRIPT_FIND:
+      search.regex = 0;
+      findSetQuery(op->text);
+      int found = scriptFind();
+      findClear();
+      if (found == -1) {
+        fprintf(stderr, "%s: %s:%d: not found\n", filename, script.name,
+                op->lineno);
+        return -1;
+      }
+      break;
+    case SCRIPT_REPLACE:
+      editorReplaceAll(op->text, op->with, op->withlen);
+      break;
+    }
+  }
+  if (!E.dirty)
+    return 0;
+
+  savejob.target = editorSaveTarget(E.filename);
+  editorSnapshotRows(&savejob);
+  if (editorWriteFile(&savejob) == -1) {
+    fprintf(stderr, "%s: can't save: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Runs the script over the files, a process per file and as many at once as
+// there are CPUs. Returns the exit status for main.
+int editorBatch(char *name, int nfiles, char **files) {
+  E.batch = 1;
+  scriptLoad(name);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int jobs = ncpu < 1 ? 1 : ncpu;
+  pid_t *pids = calloc(nfiles ? nfiles : 1, sizeof(pid_t));
+  if (pids == NULL)
+    die("calloc");
+  int next = 0, running = 0, failed = 0;
+  while (next < nfiles || running) {
+    if (next < nfiles && running < jobs) {
+      pid_t pid = fork();
+      if (pid == -1)
+        die("fork");
+      if (pid == 0) {
+        initEditor();
+        exit(scriptRun(files[next]) == -1 ? 1 : 0);
+      }
+      pids[next++] = pid;
+      running++;
+      continue;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1)
+      die("wait");
+    running--;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+    failed++;
+    for (int j = 0; j < next; j++)
+      if (pids[j] == pid)
+        fprintf(stderr, "%s: left as it was\n", files[j]);
+  }
+  free(pids);
+  return failed ? 1 : 0;
+}
+
+/* Benchmark */
+
+#ifdef KILO_BENCH
+
+// `make bench` builds kilo-bench, which times the hot paths on a made up file
+// without needing a terminal. Keys are fed through the same input buffer the
+// terminal fills and frames are drawn into a buffer that nothing reads.
+struct benchConfig {
+  int lines;
+  int linelen;
+  int tabs; // Percent of chars that are tabs
+  int iters;
+  int rows, cols;
+  int syntax; // Name the file .c so it gets highlighted
+};
+
+// What benchFind looks for, found on every 100th line
+#define BENCH_NEEDLE "needle"
+
+void benchReport(const char *name, long long ns, long long ops,
+                 const char *unit, const char *extra) {
+  printf("%-8s %12.1f ns/%-5s x%-8lld %s\n", name,
+         ops ? (double)ns / ops : 0.0, unit, ops, extra);
+}
+
+// Writes the file to benchmark against and returns its name
+char *benchMakeFile(struct benchConfig *cfg) {
+  char *path = strdup(cfg->syntax ? "/tmp/kilo-bench-XXXXXX.c"
+                                  : "/tmp/kilo-bench-XXXXXX.txt");
+  int fd = mkstemps(path, cfg->syntax ? 2 : 4);
+  if (fd == -1)
+    die("mkstemps");
+  FILE *fp = fdopen(fd, "w");
+  if (fp == NULL)
+    die("fdopen");
+
+  static const char *words[] = {"int",    "x",     "=",     "return", "{",
+                                "foo(a)", "/* */", "while", "42",     "3.14"};
+  srand(1);
+  for (int i = 0; i < cfg->lines; i++) {
+    int len = 0;
+    if (i % 100 == 0)
+      len += fprintf(fp, "%s ", BENCH_NEEDLE);
+    while (len < cfg->linelen) {
+      if (rand() % 100 < cfg->tabs) {
+        fputc('\t', fp);
+        len++;
+      } else {
+        len += fprintf(fp, "%s ", words[rand() % 10]);
+      }
+    }
+    fputc('\n', fp);
+  }
+  if (fclose(fp) == EOF)
+    die("fclose");
+  return path;
+}
+
+void benchOpen(struct benchConfig *cfg, char *path) {
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++)
+    editorOpen(path);
+  long long ns = editorNowNs() - start;
+  char extra[64];
+  snprintf(extra, sizeof(extra), "%.1f ns/row, %d slabs",
+           (double)ns / cfg->iters / (E.numrows ? E.numrows : 1),
+           E.arena.nslabs);
+  benchReport("open", ns, cfg->iters, "op", extra);
+}
+
+void benchRender(struct benchConfig *cfg) {
+  rowiter it;
+  erow *row;
+  // The first pass allocates the buffers, the rest reuse them
+  editorRowIterInit(&it, 0);
+  while ((row = editorRowIterNext(&it)) != NULL)
+    editorUpdateRow(row);
+
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++) {
+    editorRowIterInit(&it, 0);
+    while ((row = editorRowIterNext(&it)) != NULL)
+      editorUpdateRow(row);
+  }
+  benchReport("render", editorNowNs() - start,
+              (long long)cfg->iters * E.numrows, "row", "");
+}
+
+// Draws `frames` frames, calling `step` before each
+void benchDraw(const char *name, int frames, void (*step)(int frame)) {
+  static struct abuf ab = ABUF_INIT;
+  long long bytes = 0, allocs = 0;
+  long long start = editorNowNs();
+  for (int j = 0; j < frames; j++) {
+    step(j);
+    editorDrawFrame(&ab);
+    bytes += ab.len;
+    allocs += ab.allocs;
+  }
+  long long ns = editorNowNs() - start;
+  char extra[64];
+  snprintf(extra, sizeof(extra), "%lld bytes/frame, %.2f allocs/frame",
+           bytes / frames, (double)allocs / frames);
+  benchReport(name, ns, frames, "frame", extra);
+}
+
+// Every frame drawn from scratch
+void benchRedrawStep(int frame) {
+  (void)frame;
+  E.frame_valid = 0;
+}
+
+// Scrolling down a line at a time
+void benchScrollStep(int frame) {
+  E.cy = E.screenrows + frame % (E.numrows - E.screenrows);
+}
+
+// Paging down through the file with wrapping on, back to the top at the end
+void benchPageStep(int frame) {
+  (void)frame;
+  if (E.cy >= E.numrows)
+    E.cy = E.cx = 0;
+  editorMovePage(PAGE_DOWN);
+}
+
+void benchFind(struct benchConfig *cfg) {
+  static const char query[] = BENCH_NEEDLE;
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++) {
+    // As if typed in one char at a time, waiting for each scan to finish
+    char typed[sizeof(query)] = "";
+    for (int k = 0; query[k]; k++) {
+      typed[k] = query[k];
+      editorFindCallback(typed, query[k]);
+      if (search.scanning)
+        poolWait(&search.batch);
+    }
+    editorFindCallback(typed, NO_KEY);
+    editorFindCallback(typed, '\r');
+  }
+  benchReport("find", editorNowNs() - start, cfg->iters, "query", "");
+}
+
+// A long row that a regex search trying every start in turn would take
+// quadratic time over: each `a` starts a match of `a*c` that only fails at
+// the end
+#define BENCH_REGEX_LEN (1 << 20)
+
+void benchRegex(struct benchConfig *cfg) {
+  static const char pattern[] = "a*c|b";
+  regex re;
+  if (regexCompile(&re, pattern) != NULL)
+    die("regexCompile");
+  char *s = malloc(BENCH_REGEX_LEN);
+  if (s == NULL)
+    die("malloc");
+  memset(s, 'a', BENCH_REGEX_LEN - 1);
+  s[BENCH_REGEX_LEN - 1] = 'b';
+
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++) {
+    int len;
+    if (regexFind(&re, s, BENCH_REGEX_LEN, 0, &len) != BENCH_REGEX_LEN - 1 ||
+        len != 1)
+      die("regexFind");
+  }
+  benchReport("regex", editorNowNs() - start,
+              (long long)cfg->iters * BENCH_REGEX_LEN, "byte", pattern);
+  free(s);
+  regexFree(&re);
+}
+
+void benchSave(struct benchConfig *cfg, char *path) {
+  savejob.target = path;
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++) {
+    editorSnapshotRows(&savejob);
+    if (editorWriteFile(&savejob) == -1)
+      die("editorWriteFile");
+  }
+  long long ns = editorNowNs() - start;
+  savejob.target = NULL;
+  char extra[64];
+  snprintf(extra, sizeof(extra), "%.1f MB/s",
+           ns ? savejob.total * 1000.0 * cfg->iters / ns : 0.0);
+  benchReport("save", ns, cfg->iters, "op", extra);
+}
+
+// Replays a bit of editing, drawing a frame after each batch of keys like
+// the main loop does
+void benchKeys(struct benchConfig *cfg) {
+  static const char script[] = "hello world\r\x1b[A\x1b[C\x1b[C\x7f\x7f"
+                               "\tmore text\x1b[B\x1b[F\r\x1a\x19\x1b[6~"
+                               "\x1b[5~\x1b[3~typing on\x1b[D\x1b[D";
+  static struct abuf ab = ABUF_INIT;
+  int keys = 0;
+  E.cx = E.cy = 0;
+  long long start = editorNowNs();
+  for (int j = 0; j < cfg->iters; j++) {
+    for (int k = 0; script[k]; k++) {
+      // One key at a time, as they'd come from someone typing
+      input.buf[input.tail++ % INPUT_BUF_SIZE] = script[k];
+      if (script[k] == '\x1b') {
+        while (script[k + 1] && !isalpha(script[k]) && script[k] != '~')
+          input.buf[input.tail++ % INPUT_BUF_SIZE] = script[++k];
+      }
+      while (editorInputPending()) {
+        editorProcessKeypress();
+        keys++;
+      }
+      editorDrawFrame(&ab);
+    }
+  }
+  benchReport("keys", editorNowNs() - start, keys, "key", "");
+}
+
+// Lines in the file each time benchFollow rotates it
+#define BENCH_FOLLOW_LINES 1000
+
+// Rewrites the file under follow mode like a log being rotated, with half of
+// the new lines there by the time we look and the rest appended after. Only
+// the new lines may be left, and going to where the old last line was and
+// drawing must not touch what the truncation cut from the mapping.
+void benchFollow(struct benchConfig *cfg, char *path) {
+  static struct abuf ab = ABUF_INIT;
+  editorOpen(path);
+  editorFollowStart();
+  long long ns = 0;
+  for (int j = 0; j < cfg->iters; j++) {
+    int old = E.numrows;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+      die("fopen");
+    for (int i = 0; i < BENCH_FOLLOW_LINES; i++) {
+      fprintf(fp, "rotated %d\n", i);
+      if (i == BENCH_FOLLOW_LINES / 2 - 1 || i == BENCH_FOLLOW_LINES - 1) {
+        if (fflush(fp) == EOF)
+          die("fflush");
+        long long start = editorNowNs();
+        editorFollowPoll();
+        ns += editorNowNs() - start;
+      }
+    }
+    fclose(fp);
+
+    rowiter it;
+    editorRowIterInit(&it, 0);
+    char want[32], *s;
+    int len, n = 0;
+    for (; (s = editorRowIterText(&it, &len)) != NULL; n++) {
+      if (len != snprintf(want, sizeof(want), "rotated %d", n) ||
+          memcmp(s, want, len) != 0)
+        die("benchFollow");
+    }
+    if (n != BENCH_FOLLOW_LINES)
+      die("benchFollow");
+    E.cy = old - 1 < E.numrows ? old - 1 : E.numrows - 1;
+    E.cx = 0;
+    editorDrawFrame(&ab);
+    E.cy = E.cx = 0;
+    editorDrawFrame(&ab);
+  }
+  benchReport("follow", ns, cfg->iters, "op", "");
+}
+
+int editorBench(int argc, char *argv[]) {
+  struct benchConfig cfg = {100000, 80, 5, 10, 50, 200, 0};
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:t:i:r:c:s")) != -1) {
+    switch (opt) {
+    case 'n':
+      cfg.lines = atoi(optarg);
+      break;
+    case 'l':
+      cfg.linelen = atoi(optarg);
+      break;
+    case 't':
+      cfg.tabs = atoi(optarg);
+      break;
+    case 'i':
+      cfg.iters = atoi(optarg);
+      break;
+    case 'r':
+      cfg.rows = atoi(optarg);
+      break;
+    case 'c':
+      cfg.cols = atoi(optarg);
+      break;
+    case 's':
+      cfg.syntax = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n lines] [-l line length] [-t tab %%] "
+              "[-i iterations] [-r rows] [-c cols] [-s]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (cfg.lines < cfg.rows)
+    cfg.lines = cfg.rows;
+  if (cfg.iters < 1)
+    cfg.iters = 1;
+  editorSetScreenSize(cfg.rows, cfg.cols);
+
+  char *path = benchMakeFile(&cfg);
+  printf("%d lines of %d chars, %d%% tabs, %dx%d screen%s\n", cfg.lines,
+         cfg.linelen, cfg.tabs, cfg.rows, cfg.cols,
+         cfg.syntax ? ", highlighted as C" : "");
+  benchOpen(&cfg, path);
+  benchRender(&cfg);
+  benchDraw("redraw", cfg.iters * 10, benchRedrawStep);
+  benchDraw("scroll", cfg.iters * 100, benchScrollStep);
+  E.wrap = 1;
+  editorWrapInvalidate();
+  benchDraw("wrapped", cfg.iters * 100, benchPageStep);
+  E.wrap = 0;
+  E.cy = E.cx = E.rowoff = E.wrapoff = 0;
+  benchFind(&cfg);
+  benchRegex(&cfg);
+  benchSave(&cfg, path);
+  benchKeys(&cfg);
+  benchFollow(&cfg, path);
+
+  editorCloseFile();
+  unlink(path);
+  free(path);
+  return 0;
+}
+
+#endif
+
 /* Init */
 
 void initEditor() {
   E.cx = E.cy = E.rx = E.rowoff = E.coloff = E.numrows = E.dirty = 0;
-  E.row = NULL;
+  E.wrap = E.wrapoff = 0;
+  E.nbuffers = 1;
+  editorInitWakeup();
+  editorGuardMap();
+  E.rows = (rownode *)rowtreeNewLeaf();
+  memset(&E.arena, 0, sizeof(E.arena));
+  E.map = NULL;
+  E.maplen = 0;
   E.filename = NULL;
+  E.syntax = NULL;
+  E.hl_valid = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.frame = NULL;
+  E.framerows = E.framecols = 0;
+  E.frame_valid = 0;
+}
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+// Sizes the screen to the terminal and keeps it that way
+void initScreen() {
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
     die("getWindowSize");
-
-  // Reserve one line for the status bar
-  E.screenrows -= 2;
+  editorSetScreenSize(rows, cols);
+  editorInitSignals();
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+#ifdef KILO_BENCH
   initEditor();
-  if (argc >= 2)
-    editorOpen(argv[1]);
-
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  return editorBench(argc, argv);
+#endif
+
+  int following = 0;
+  char *scriptname = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "frs:")) != -1) {
+    switch (opt) {
+    case 'f':
+      following = 1;
+      break;
+    case 'r':
+      E.readonly = 1;
+      break;
+    case 's':
+      scriptname = optarg;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-f | -r] [file...]\n       %s -s script file...\n",
+              argv[0], argv[0]);
+      exit(1);
+    }
+  }
+  if (scriptname)
+    return editorBatch(scriptname, argc - optind, &argv[optind]);
 
+  editorTraceStart();
+  enableRawMode();
+  initEditor();
+  initScreen();
+  // Anything opening the files has to say, e.g. about recovering from a swap
+  // file, goes over the help
+  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | "
+                         "Ctrl-F = find | Ctrl-Z/Y = undo/redo");
+  if (optind < argc)
+    editorOpen(argv[optind]);
+  for (int i = optind + 1; i < argc; i++)
+    editorBufferOpen(argv[i]);
+  editorBufferSwitch(0);
+  if (following && !E.readonly)
+    editorFollowStart();
+
+  // Redraw once for all the keys that came in together, and log their edits
+  // to the swap file with a single write
   while (1) {
+    journalFlush();
     editorRefreshScreen();
-    editorProcessKeypress();
+    do
+      editorProcessKeypress();
+    while (editorInputPending());
   }
 
   return 0;